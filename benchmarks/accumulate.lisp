@@ -0,0 +1,15 @@
+; Builds a string and a vector by rebinding them to longer copies of
+; themselves. Expects the number of items as an argument.
+(= args ($ argv 1))
+(.= args parse)
+(= n (@ 0 args))
+
+(= text "")
+(= items [])
+(= i 0)
+(while! (< i n) (do
+    (,= text "ab")
+    (= items (push! i items))
+    (++ i)
+))
+(putl! (# text) " " (# items))
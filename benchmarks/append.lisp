@@ -0,0 +1,13 @@
+; Builds a vector by appending to a copy of it once per item.
+; Expects the length of the vector as an argument.
+(= args ($ argv 1))
+(.= args parse)
+(= n (@ 0 args))
+
+(= out [])
+(= i 0)
+(while! (< i n) (do
+    (= out (push! i out))
+    (++ i)
+))
+(putl! (# out))
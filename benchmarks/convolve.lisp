@@ -0,0 +1,29 @@
+; Convolves a signal with a kernel, making a window and a product for every
+; item of the output.
+; Expects the length of the kernel and the signal as arguments.
+(use! "functional")
+(= args ($ argv 1))
+(.= args parse)
+(= n_kernel (@ 0 args))
+(= n_signal (@ 1 args))
+
+(=> convolve [kernel signal] (do
+    (= kernel (rev! kernel))
+    (= n (# kernel))
+    (= out [])
+    (= signal (, (repeat (- n 1) 0) signal (repeat n 0)))
+
+    (= l (- (# signal) n))
+    (= i 0)
+
+    (while! (< i l) (do
+        (= window ($ signal i (+ i n -1)))
+        (push out (/ + (. * kernel window)))
+        (++ i)
+    ))
+
+    out
+))
+
+(= result (convolve (repeat n_kernel (// 1. 3.)) (range n_signal)))
+(putl! (# result))
@@ -0,0 +1,44 @@
+; Searches a short vector many times, finding the item at its end either by
+; returning early, by breaking out of the loop, or by letting the loop finish.
+; Expects the way to search (0 to finish, 1 to break, 2 to return) and the
+; number of searches as arguments. Leaving early should cost no more than
+; finishing the loop.
+(= args ($ argv 1))
+(.= args parse)
+(= mode (@ 0 args))
+(= n (@ 1 args))
+
+(= items (range 8))
+
+(=> by_finishing {target} (do
+    (= found Nil)
+    (= i 0)
+    (while! (< i (# items))
+        (if! (== (@ i items) target) (= found i))
+        (++ i)
+    )
+    found
+))
+
+(=> by_breaking {target} (do
+    (= found Nil)
+    (= i 0)
+    (while! (< i (# items))
+        (if! (== (@ i items) target) (do (= found i) (break)))
+        (++ i)
+    )
+    found
+))
+
+(=> by_returning {target} (do
+    (= i 0)
+    (while! (< i (# items))
+        (if! (== (@ i items) target) (return i))
+        (++ i)
+    )
+    Nil
+))
+
+(= search (@ mode [by_finishing by_breaking by_returning]))
+(= results (. #[search 7] (range n)))
+(putl! (# results) " " (@ 0 results))
@@ -0,0 +1,10 @@
+; Sorts the same numbers as the insertion sort benchmark, using the builtins.
+; Expects the length of the list as an argument.
+(= args ($ argv 1))
+(.= args parse)
+(= n (@ 0 args))
+
+(= items (. #[% (* _ 7919) 1009] (range n)))
+(= result (sort items))
+(= by_digit (stable_sort_by #[% _ 10] items))
+(putl! (# result) (# by_digit))
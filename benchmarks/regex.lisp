@@ -0,0 +1,14 @@
+; Runs `findall`, `split` and `match` over one long generated log, so that
+; the time goes into matching rather than into compiling patterns.
+; Expects the number of lines in the log as an argument.
+(= args ($ argv 1))
+(.= args parse)
+(= n (@ 0 args))
+
+(= line "GET /index.html 200 user=alice@example.com took 12ms\n")
+(= log (apply join (repeat n line)))
+
+(putl! (# (findall "\\w+@\\w+\\.com" log)))
+(putl! (# (split "\\s+" log)))
+(putl! (# (findall "\\b\\d+ms\\b" log)))
+(putl! (match "(?:[A-Z]+ \\S+ \\d+ [^\\n]*\\n)*" log))
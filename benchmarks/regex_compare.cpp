@@ -0,0 +1,86 @@
+/* Times the searches of regex.lisp with the engine in nfa.h and with
+`std::regex`, which the builtins used before, on the same generated log.
+
+Expects the number of lines in the log as an argument. The matcher of
+libstdc++ recurses once per character, so `std::regex_match` is only run when
+the log is at most `STD_MATCH_LIMIT` bytes long. */
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <regex>
+#include <string>
+
+#include "../source/cpp/nfa.h"
+
+const size_t STD_MATCH_LIMIT = 1 << 14;
+
+/* Get the wall time of running a function in seconds, and what it returned. */
+std::pair<double, size_t> _time(const std::function<size_t()> &run) {
+    auto start = std::chrono::steady_clock::now();
+    auto result = run();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return {elapsed.count(), result};
+}
+
+/* Print the times of both engines, or of ours alone if `theirs` is empty. */
+void _report(const std::string &label,
+             std::pair<double, size_t> ours,
+             std::optional<std::pair<double, size_t>> theirs) {
+    std::cout << std::left << std::setw(40) << label << std::right << std::fixed
+              << std::setprecision(4) << "nfa " << std::setw(8) << ours.first
+              << "s  std::regex ";
+    if (!theirs) {
+        std::cout << "skipped\n";
+        return;
+    }
+    std::cout << std::setw(8) << theirs->first << "s";
+    if (ours.second != theirs->second) std::cout << "  (results differ)";
+    std::cout << "\n";
+}
+
+void compare_find_all(const std::string &pattern, const std::string &text) {
+    nfa::Regex ours(pattern);
+    std::regex theirs(pattern);
+
+    _report(
+        "findall " + pattern,
+        _time([&] { return ours.find_all(text).size(); }),
+        _time([&] {
+            std::sregex_iterator begin(text.begin(), text.end(), theirs), end;
+            return (size_t)std::distance(begin, end);
+        }));
+}
+
+void compare_full_match(const std::string &pattern, const std::string &text) {
+    nfa::Regex ours(pattern);
+    auto timed = _time([&] { return (size_t)ours.full_match(text); });
+
+    if (text.size() > STD_MATCH_LIMIT) {
+        _report("match " + pattern, timed, std::nullopt);
+        return;
+    }
+
+    std::regex theirs(pattern);
+    _report("match " + pattern,
+            timed,
+            _time([&] { return (size_t)std::regex_match(text, theirs); }));
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: regex_compare <lines>\n";
+        return 1;
+    }
+
+    std::string line = "GET /index.html 200 user=alice@example.com took 12ms\n";
+    std::string log;
+    for (auto n = std::stoul(argv[1]); n > 0; n--) log += line;
+
+    compare_find_all("\\w+@\\w+\\.com", log);
+    compare_find_all("\\s+", log);
+    compare_find_all("\\b\\d+ms\\b", log);
+    compare_full_match("(?:[A-Z]+ \\S+ \\d+ [^\\n]*\\n)*", log);
+}
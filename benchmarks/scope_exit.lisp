@@ -0,0 +1,17 @@
+; Calls a closure many times with many global variables set.
+; Expects the number of globals and the number of calls as arguments.
+; The time per call should not depend on the number of globals.
+(= args ($ argv 1))
+(.= args parse)
+(= n_globals (@ 0 args))
+(= n_calls (@ 1 args))
+
+(= i 0)
+(while! (< i n_globals) (do
+    (parse (join (chr 40) "let global_" (repr i) " 0" (chr 41)))
+    (++ i)
+))
+
+(=> increment (+ _ 1))
+(= result (. increment (range n_calls)))
+(putl! (# result))
@@ -0,0 +1,34 @@
+; Insertion sorts a list, building a new linked list for every item.
+; Expects the length of the list as an argument.
+(= args ($ argv 1))
+(.= args parse)
+(= n (@ 0 args))
+
+(=> _insert_into_sorted [item _list] (do
+    (= l (# _list))
+    (= i (- l 1))
+    (= ptr l)
+
+    (while! (>= i 0) (do
+        (= ptr (? (> (@ i _list) item) i ptr))
+        (-- i)
+    ))
+
+    (linsert item ptr _list)
+))
+
+(=> insertion_sort [_list] (do
+    (= out l[])
+    (= i 0)
+    (= l (# _list))
+
+    (while! (< i l) (do
+        (= out (_insert_into_sorted (@ i _list) out))
+        (++ i)
+    ))
+
+    out
+))
+
+(= result (insertion_sort (. #[% (* _ 7919) 1009] (range n))))
+(putl! (# result))
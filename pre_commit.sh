@@ -9,6 +9,18 @@ for i in tests/*.lisp; do
     ./lisp --log DEBUG $i
 done
 
+# Runs them again in the tree walker, collecting garbage often to catch values
+# which aren't reachable from the roots.
+for i in tests/*.lisp; do
+    ./lisp --engine tree --gc-threshold 256 $i
+done
+
+# Runs the tests which fail on purpose, checking the error named on their first
+# line.
+for i in tests/errors/*.lisp; do
+    ./lisp $i | grep -qF "$(head -n 1 $i | sed 's/^; Prints: //')"
+done
+
 # Saves the dependency tree for easy access.
 python source/python/includetree.py source/cpp/lisp.cpp > includetree.txt
 
@@ -0,0 +1,408 @@
+/* Compiles Lisp trees into bytecode for the virtual machine in `vm.h`.
+
+A chunk is compiled from one node of a `Tree<LispVar>`, and contains a flat
+list of instructions along with the constants they refer to. The compiler
+follows the same rules as `evaluate_expression`, so running a chunk gives the
+same result as walking the tree it was compiled from.
+
+The loops and branches created by the `while!` and `if!` macros are compiled
+into jumps instead of being captured as expressions and evaluated later.
+
+Rebinding a variable to `insert`, `join` or `slice` of itself, as the `push!`,
+`pop!`, `,=` and `$=` macros do, is compiled into an update which can change
+the value in place when the variable holds the only reference to it.
+
+Calls whose value is returned straight away are compiled into tail calls, which
+reuse the frame of the closure making them.
+*/
+#include <cstdint>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern VariableScope<LispVar> VARIABLE_SCOPE;
+
+unsigned int _slot_of(LispVar name);
+
+enum OpCode : uint8_t {
+    OP_PUSH_CONST,     // Push constant `a`.
+    OP_LOAD_VAR,       // Push the variable in slot `a`.
+    OP_STORE_VAR,      // Bind the variable in slot `a` to the top.
+    OP_TAKE_VAR,       // Push the variable in slot `a` to be updated.
+    OP_UPDATE_VAR,     // Call the node's builtin with the top `b` items and
+                       // bind the variable in slot `a` to the result.
+    OP_POP,            // Discard the top of the stack.
+    OP_CHECK_CALLEE,   // Jump to `a` if the top is not callable.
+    OP_CALL,           // Call the item below the top `a` items with them.
+    OP_TAIL_CALL,      // Call like OP_CALL, in place of the current closure.
+    OP_CALL_BUILTIN,   // Call the builtin in constant `a` with the top `b`.
+    OP_JUMP,           // Jump to `a`.
+    OP_JUMP_IF_FALSE,  // Pop the top and jump to `a` if it is falsy.
+    OP_LOOP_ENTER,     // Jump to `a` if the loop body breaks.
+    OP_LOOP_EXIT,      // Leave the innermost loop body.
+    OP_LOOP_NEXT,      // Finish an iteration of the loop.
+    OP_BREAK,          // Break out of the innermost loop.
+    OP_EARLY_RETURN,   // Return the top from the innermost closure.
+    OP_RETURN,         // Return the top from the chunk.
+};
+
+const std::vector<std::string> OPCODE_NAMES = {
+    "PUSH_CONST",
+    "LOAD_VAR",
+    "STORE_VAR",
+    "TAKE_VAR",
+    "UPDATE_VAR",
+    "POP",
+    "CHECK_CALLEE",
+    "CALL",
+    "TAIL_CALL",
+    "CALL_BUILTIN",
+    "JUMP",
+    "JUMP_IF_FALSE",
+    "LOOP_ENTER",
+    "LOOP_EXIT",
+    "LOOP_NEXT",
+    "BREAK",
+    "EARLY_RETURN",
+    "RETURN",
+};
+
+// Set in `b` of an update whose result is popped right away, so that the
+// variable is left with the only reference to it.
+const uint32_t RESULT_UNUSED = 1u << 31;
+
+struct Instruction {
+    OpCode op;
+    uint32_t a;
+    uint32_t b;
+};
+
+/* A compiled piece of bytecode. */
+class Chunk {
+   public:
+    std::vector<Instruction> code;
+    std::vector<unsigned int> nodes;  // Tree node of each instruction.
+    std::vector<LispVar> constants;
+    LispVar source;  // The EXPRESSION the chunk was compiled from.
+
+    unsigned int max_stack = 0;  // Most stack slots used at once.
+    unsigned int stack_depth = 0;
+
+    /* Append an instruction which changes the stack height by `effect`,
+    returning its address. */
+    unsigned int emit(OpCode op,
+                      unsigned int node,
+                      uint32_t a = 0,
+                      uint32_t b = 0,
+                      int effect = 0) {
+        code.push_back({op, a, b});
+        nodes.push_back(node);
+        stack_depth += effect;
+        max_stack = std::max(max_stack, stack_depth);
+        return code.size() - 1;
+    }
+
+    unsigned int add_constant(LispVar value) {
+        constants.push_back(value);
+        return constants.size() - 1;
+    }
+
+    /* Make the jump at `address` point to the next instruction. */
+    void patch(unsigned int address) { code[address].a = code.size(); }
+
+    std::string to_str() {
+        std::stringstream ss;
+        auto size = code.size();
+        for (size_t i = 0; i < size; i++) {
+            auto ins = code[i];
+            ss << i << "\t" << OPCODE_NAMES[ins.op] << "\t" << ins.a << "\t"
+               << ins.b;
+            if (ins.op == OP_PUSH_CONST || ins.op == OP_CALL_BUILTIN) {
+                ss << "\t; " << constants[ins.a].to_str();
+            }
+            if (ins.op == OP_LOAD_VAR || ins.op == OP_STORE_VAR ||
+                ins.op == OP_TAKE_VAR || ins.op == OP_UPDATE_VAR) {
+                ss << "\t; " << SYMBOLS.name(ins.a);
+            }
+            if (i != size - 1) ss << "\n";
+        }
+        return ss.str();
+    }
+};
+
+void _compile_node(Chunk *chunk, unsigned int index);
+
+std::map<std::pair<Tree<LispVar> *, unsigned int>, LispVar> CAPTURE_CACHE;
+
+/* Get an `expression` node and its children as an EXPRESSION.
+
+Trees are never changed once they are built, so the node is only copied out
+the first time and then shared. This keeps the branches of `if!` and `while!`
+from being copied every time the tree walker gets to them. */
+LispVar capture_expression(Tree<LispVar> *tree, unsigned int index) {
+    auto key = std::make_pair(tree, index);
+    auto pos = CAPTURE_CACHE.find(key);
+    if (pos != CAPTURE_CACHE.end()) return pos->second;
+
+    LispVar captured;
+    captured.set_tree(EXPRESSION, gc_new<Tree<LispVar>>());
+    *captured.tree() = tree->subtree(index);
+
+    // The capture lives as long as the tree, which may be the older one.
+    GC.write_barrier(tree, captured);
+
+    CAPTURE_CACHE[key] = captured;
+    return captured;
+}
+
+bool _is_builtin_node(Tree<LispVar> *tree,
+                      unsigned int index,
+                      LispBuiltin builtin) {
+    auto node = tree->nodes[index];
+    return node.tag() == BUILTIN && node.builtin() == builtin;
+}
+
+/* Whether or not a node is an `expression` with something to evaluate. */
+bool _is_capture_node(Tree<LispVar> *tree, unsigned int index) {
+    return _is_builtin_node(tree, index, B_EXPRESSION) &&
+           !tree->children(index).empty();
+}
+
+/* Compile the first child of an `expression` node, which is the part
+evaluated by `eval_expr` and `while`. */
+void _compile_captured(Chunk *chunk, unsigned int index) {
+    _compile_node(chunk, index + 1);
+}
+
+/* Discard the value on top of the stack. If an update produced it, its
+variable is then left with the only reference to it. */
+void _emit_pop(Chunk *chunk, unsigned int index) {
+    if (!chunk->code.empty() && chunk->code.back().op == OP_UPDATE_VAR) {
+        chunk->code.back().b |= RESULT_UNUSED;
+    }
+    chunk->emit(OP_POP, index, 0, 0, -1);
+}
+
+/* Get which argument of a builtin can be updated in place, or -1. */
+int _updated_argument(LispBuiltin builtin) {
+    if (builtin == B_JOIN || builtin == B_SLICE) return 0;
+    if (builtin == B_INSERT) return 2;
+    return -1;
+}
+
+/* Compile (let x (builtin ... x ...)) into an update of `x`, returning
+whether or not the node could be compiled this way. */
+bool _compile_update(Chunk *chunk, unsigned int index) {
+    auto tree = chunk->source.tree();
+    auto value = index + 2;
+    auto slot = _slot_of(tree->nodes[index + 1]);
+    auto node = tree->nodes[value];
+    if (node.tag() != BUILTIN) return false;
+
+    auto children = tree->children(value);
+    int target = _updated_argument(node.builtin());
+    if (target < 0 || (int)children.size() <= target) return false;
+
+    auto variable = tree->nodes[children[target]];
+    if (variable.tag() != VARIABLE || variable.slot() != slot ||
+        !tree->children(children[target]).empty()) {
+        return false;
+    }
+
+    for (int i = 0; i < (int)children.size(); i++) {
+        if (i == target) {
+            chunk->emit(OP_TAKE_VAR, children[i], slot, 0, 1);
+        } else {
+            _compile_node(chunk, children[i]);
+        }
+    }
+    chunk->emit(OP_UPDATE_VAR,
+                value,
+                slot,
+                children.size(),
+                1 - (int)children.size());
+    return true;
+}
+
+/* Compile the builtins which control the flow of execution into jumps,
+returning whether or not the node could be compiled this way. */
+bool _compile_control_flow(Chunk *chunk,
+                           unsigned int index,
+                           std::vector<unsigned int> children) {
+    auto tree = chunk->source.tree();
+    auto op = tree->nodes[index].builtin();
+    auto n_children = children.size();
+    bool no_args =
+        n_children == 1 && tree->nodes[children[0]].tag() == __NO_ARGS__;
+
+    // (do a b c) evaluates everything and keeps the last value.
+    if (op == B_DO && n_children && !no_args) {
+        for (size_t i = 0; i < n_children; i++) {
+            if (i) _emit_pop(chunk, index);
+            _compile_node(chunk, children[i]);
+        }
+        return true;
+    }
+
+    // (while (expression cond) (expression body))
+    if (op == B_WHILE && n_children == 2 && _is_capture_node(tree, children[0]) &&
+        _is_capture_node(tree, children[1])) {
+        unsigned int start = chunk->code.size();
+        _compile_captured(chunk, children[0]);
+        auto exit_jump = chunk->emit(OP_JUMP_IF_FALSE, index, 0, 0, -1);
+        auto enter = chunk->emit(OP_LOOP_ENTER, index);
+        _compile_captured(chunk, children[1]);
+        _emit_pop(chunk, index);
+        chunk->emit(OP_LOOP_EXIT, index);
+        chunk->emit(OP_LOOP_NEXT, index);
+        chunk->emit(OP_JUMP, index, start);
+
+        // Breaking out of the body skips straight to here.
+        chunk->patch(enter);
+        chunk->emit(OP_LOOP_EXIT, index);
+        chunk->patch(exit_jump);
+        chunk->emit(OP_PUSH_CONST,
+                    index,
+                    chunk->add_constant(*_SINGLETON_NIL),
+                    0,
+                    1);
+        return true;
+    }
+
+    // (eval_expr (? cond (expression yes) (expression no)))
+    if (op == B_EVAL_EXPR && n_children == 1 &&
+        _is_builtin_node(tree, children[0], B_TERNARY)) {
+        auto branches = tree->children(children[0]);
+        if (branches.size() != 3 || !_is_capture_node(tree, branches[1]) ||
+            !_is_capture_node(tree, branches[2])) {
+            return false;
+        }
+
+        _compile_node(chunk, branches[0]);
+        // The second operand makes the condition get type checked like `?`.
+        bool checked = !tree->nodes[children[0]].is_proven();
+        auto else_jump = chunk->emit(OP_JUMP_IF_FALSE, index, 0, checked, -1);
+        _compile_captured(chunk, branches[1]);
+        auto end_jump = chunk->emit(OP_JUMP, index);
+        chunk->patch(else_jump);
+        chunk->stack_depth--;
+        _compile_captured(chunk, branches[2]);
+        chunk->patch(end_jump);
+        return true;
+    }
+
+    if (op == B_BREAK && no_args) {
+        // The instruction never falls through, but the slot it would
+        // have produced is still counted.
+        chunk->emit(OP_BREAK, index, 0, 0, 1);
+        return true;
+    }
+
+    if (op == B_RETURN && n_children == 1 && !no_args) {
+        _compile_node(chunk, children[0]);
+        chunk->emit(OP_EARLY_RETURN, index);
+        return true;
+    }
+
+    return false;
+}
+
+/* Compile a node and its children so that running the code leaves the value
+of the node on top of the stack. */
+void _compile_node(Chunk *chunk, unsigned int index) {
+    auto tree = chunk->source.tree();
+    auto node = tree->nodes[index];
+    auto children = tree->children(index);
+    auto n_children = children.size();
+
+    // Variables are only called if they turn out to be callable.
+    if (node.tag() == VARIABLE) {
+        auto load = chunk->emit(OP_LOAD_VAR, index, node.slot(), 0, 1);
+        if (n_children) {
+            auto check = chunk->emit(OP_CHECK_CALLEE, index);
+            for (auto child : children) _compile_node(chunk, child);
+            chunk->emit(OP_CALL, index, n_children, 0, -n_children);
+            chunk->patch(check);
+        }
+        chunk->code[load].b = chunk->code.size();
+        return;
+    }
+
+    if (node.tag() == CLOSURE && n_children) {
+        chunk->emit(OP_PUSH_CONST, index, chunk->add_constant(node), 0, 1);
+        for (auto child : children) _compile_node(chunk, child);
+        chunk->emit(OP_CALL, index, n_children, 0, -n_children);
+        return;
+    }
+
+    if (node.tag() == BUILTIN) {
+        // Capture expressions literally, once.
+        if (node.builtin() == B_EXPRESSION) {
+            auto captured = capture_expression(tree, index);
+            chunk->emit(
+                OP_PUSH_CONST, index, chunk->add_constant(captured), 0, 1);
+            return;
+        }
+
+        if (node.builtin() == B_LET && index + 2 < tree->size()) {
+            if (_compile_update(chunk, index)) return;
+            _compile_node(chunk, index + 2);
+            chunk->emit(OP_STORE_VAR, index, _slot_of(tree->nodes[index + 1]));
+            return;
+        }
+
+        if (n_children) {
+            if (_compile_control_flow(chunk, index, children)) return;
+
+            for (auto child : children) _compile_node(chunk, child);
+            chunk->emit(OP_CALL_BUILTIN,
+                        index,
+                        chunk->add_constant(node),
+                        n_children,
+                        1 - (int)n_children);
+            return;
+        }
+    }
+
+    // Anything else evaluates to itself, ignoring its children.
+    chunk->emit(OP_PUSH_CONST, index, chunk->add_constant(node), 0, 1);
+}
+
+/* Turn the calls which are followed by nothing but a return into tail calls.
+
+Jumps are followed to find what comes after a call, since the branches of an
+`if!` jump to the end of the chunk. A `?` evaluates both of its branches before
+picking one, so calls in them are never tail calls. */
+void _mark_tail_calls(Chunk *chunk) {
+    auto &code = chunk->code;
+    for (size_t i = 0; i < code.size(); i++) {
+        if (code[i].op != OP_CALL) continue;
+
+        auto next = i + 1;
+        while (code[next].op == OP_JUMP) next = code[next].a;
+        if (code[next].op == OP_RETURN || code[next].op == OP_EARLY_RETURN) {
+            code[i].op = OP_TAIL_CALL;
+        }
+    }
+}
+
+std::map<std::pair<Tree<LispVar> *, unsigned int>, Chunk *> CHUNK_CACHE;
+
+/* Get the bytecode for a node of an expression, compiling it the first time
+it is requested. */
+Chunk *compile_chunk(Tree<LispVar> *tree, unsigned int index) {
+    auto key = std::make_pair(tree, index);
+    auto pos = CHUNK_CACHE.find(key);
+    if (pos != CHUNK_CACHE.end()) return pos->second;
+
+    auto chunk = new Chunk;
+    chunk->source.set_tree(EXPRESSION, tree);
+    _compile_node(chunk, index);
+    chunk->emit(OP_RETURN, index, 0, 0, -1);
+    _mark_tail_calls(chunk);
+
+    CHUNK_CACHE[key] = chunk;
+    return chunk;
+}
@@ -0,0 +1,73 @@
+/* Limits how long a program may run, by the number of steps it takes and by
+the time it takes.
+
+A step is a node evaluated by the tree walker or an instruction run by the
+virtual machine. All either engine does per step is count it down, and the
+limits are only looked at once the count runs out. That happens every
+FUEL_CHECK_INTERVAL steps, or sooner when fewer steps than that are left. */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+// Most steps taken between two looks at the limits.
+const uint64_t FUEL_CHECK_INTERVAL = 1 << 14;
+
+class Fuel {
+   public:
+    uint64_t ticks = FUEL_CHECK_INTERVAL;  // Steps until the next check.
+
+    /* Stop the program once it has taken more than `steps` steps, or never
+    if it is 0. */
+    void set_max_steps(uint64_t steps) {
+        max_steps = steps;
+        _refill();
+    }
+
+    /* Stop the program once it has run for more than `seconds` seconds from
+    now, or never if it is 0. */
+    void set_timeout(double seconds) {
+        timeout = seconds;
+        deadline = std::chrono::steady_clock::now() +
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::duration<double>(seconds));
+    }
+
+    /* Count a step. */
+    void burn() {
+        if (!--ticks) _check();
+    }
+
+   private:
+    uint64_t max_steps = 0;
+    uint64_t steps = 0;  // Steps taken before the current slice.
+    uint64_t slice = FUEL_CHECK_INTERVAL;
+    double timeout = 0;
+    std::chrono::steady_clock::time_point deadline;
+
+    void _check() {
+        steps += slice;
+        if (max_steps && steps > max_steps) {
+            std::cout << "[TimeoutError] The program took more than "
+                      << max_steps << " steps.\n";
+            exit(1);
+        }
+        if (timeout && std::chrono::steady_clock::now() > deadline) {
+            std::cout << "[TimeoutError] The program ran for more than "
+                      << timeout << " seconds.\n";
+            exit(1);
+        }
+        _refill();
+    }
+
+    /* Start a slice which ends at the next check. */
+    void _refill() {
+        slice = FUEL_CHECK_INTERVAL;
+        // The slice ends on the first step past the limit.
+        if (max_steps) slice = std::min(slice, max_steps + 1 - steps);
+        ticks = slice;
+    }
+};
+
+Fuel FUEL;
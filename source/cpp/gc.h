@@ -0,0 +1,466 @@
+/* A mark-and-sweep garbage collector for the payloads of LispVars.
+
+Strings, vectors, lists and trees made while a program runs are allocated with
+`gc_new`. Each kind of payload has a slab of fixed size slots, which are
+handed out from large blocks with a bump pointer and reused once freed. A
+collection marks everything that can be reached from the roots and frees the
+rest. Payloads which were not allocated with `gc_new` (such as the parsed
+program) are never freed, but are still searched for references.
+
+The roots are given by whoever starts the collection, along with any values
+protected with a `GCRoot` while they are only held by C++ code.
+
+Most payloads only live for a single call, so every closure call also opens a
+region. When the call returns, whatever was allocated in the region and can't
+be reached from the returned value is freed at once, and the rest is promoted
+out of the region for the collector to deal with. Since scoping is dynamic, a
+callee can only bind variables in its own scope, which is gone by the time it
+returns. The only other way a value can outlive the region is by being pushed
+into an older container, so such values are remembered until then.
+*/
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Least number of allocations between two collections, unless another is set
+// on the command line.
+const size_t GC_MIN_THRESHOLD = 1 << 16;
+
+// Allocations made in the region of a call before a tail call from it starts
+// the region again.
+const size_t GC_RENEW_THRESHOLD = 1 << 10;
+
+// Size (and alignment) of the blocks slots are carved out of.
+const size_t GC_BLOCK_SIZE = 1 << 16;
+
+void _mark_compiled(Tree<LispVar> *tree);
+void _forget_compiled(Tree<LispVar> *tree);
+void _push_captures(Tree<LispVar> *tree, std::vector<LispVar> &pending);
+
+enum GCKind : uint8_t {
+    GC_STRING,
+    GC_VECTOR,
+    GC_LIST,
+    GC_TREE,
+    GC_NUMBER,  // Integers too large to store in a LispVar.
+};
+
+const size_t GC_KINDS = 5;
+
+GCKind _gc_kind(std::string *) { return GC_STRING; }
+GCKind _gc_kind(PersistentVector<LispVar> *) { return GC_VECTOR; }
+GCKind _gc_kind(std::deque<LispVar> *) { return GC_LIST; }
+GCKind _gc_kind(Tree<LispVar> *) { return GC_TREE; }
+GCKind _gc_kind(long *) { return GC_NUMBER; }
+
+/* Stored right before every payload allocated with `gc_new`. */
+struct GCHeader {
+    size_t sequence;  // Allocation number while in a region, otherwise 0.
+    GCKind kind;
+    bool live;
+    bool marked;
+};
+
+/* Fixed size slots for one kind of payload. */
+struct GCSlab {
+    size_t slot_size;
+    char *bump = nullptr;
+    char *end = nullptr;
+    std::vector<char *> blocks;
+    std::vector<char *> free_slots;
+};
+
+/* Everything allocated since a closure was called. */
+struct GCRegion {
+    size_t first;       // Sequence number of the first allocation.
+    size_t remembered;  // Number of remembered values at the start.
+};
+
+class GarbageCollector {
+   public:
+    std::vector<std::pair<LispVar *, size_t>> roots;  // Protected spans.
+    std::vector<GCRegion> regions;
+    size_t allocations = 0;  // Allocations since the last collection.
+    size_t min_threshold = GC_MIN_THRESHOLD;
+    size_t threshold = GC_MIN_THRESHOLD;
+
+    // Statistics reported by `--gc-stats`.
+    size_t collections = 0;
+    size_t objects_freed = 0;
+    size_t region_objects_freed = 0;
+    size_t bytes_freed = 0;
+    size_t peak_bytes = 0;
+
+    GarbageCollector() {
+        slabs[GC_STRING].slot_size = _slot_size(sizeof(std::string));
+        slabs[GC_VECTOR].slot_size = _slot_size(sizeof(PersistentVector<LispVar>));
+        slabs[GC_LIST].slot_size = _slot_size(sizeof(std::deque<LispVar>));
+        slabs[GC_TREE].slot_size = _slot_size(sizeof(Tree<LispVar>));
+        slabs[GC_NUMBER].slot_size = _slot_size(sizeof(long));
+    }
+
+    template <class T>
+    T *allocate() {
+        auto kind = _gc_kind((T *)nullptr);
+        auto header = (GCHeader *)_take_slot(kind);
+        header->kind = kind;
+        header->live = true;
+        header->marked = false;
+        header->sequence = 0;
+
+        auto pointer = new (header + 1) T;
+        if (!regions.empty()) {
+            header->sequence = ++sequence;
+            young.push_back(pointer);
+        }
+        allocations++;
+        return pointer;
+    }
+
+    bool should_collect() { return allocations >= threshold; }
+
+    /* Collect after at least `allocations` allocations instead of
+    GC_MIN_THRESHOLD. */
+    void set_min_threshold(size_t allocations) {
+        min_threshold = threshold = allocations;
+    }
+
+    /* Mark a value and everything reachable from it. */
+    void mark(LispVar value) {
+        pending.push_back(value);
+
+        while (!pending.empty()) {
+            auto item = pending.back();
+            pending.pop_back();
+
+            auto payload = _payload(item);
+            if (!payload) continue;
+
+            auto header = _header(payload);
+            if (header) {
+                if (header->marked) continue;
+                header->marked = true;
+            } else if (!visited.insert(payload).second) {
+                continue;
+            }
+            _push_children(item);
+        }
+    }
+
+    /* Mark the values protected by `GCRoot`s or remembered by regions. */
+    void mark_roots() {
+        for (auto span : roots) {
+            for (size_t i = 0; i < span.second; i++) mark(span.first[i]);
+        }
+        for (auto &value : remembered) mark(value);
+    }
+
+    /* Free everything which has not been marked since the last sweep. */
+    void sweep() {
+        size_t heap_bytes = 0;
+        size_t live = 0;
+
+        for (size_t kind = 0; kind < GC_KINDS; kind++) {
+            auto &slab = slabs[kind];
+
+            for (auto block : slab.blocks) {
+                for (size_t offset = 0; offset + slab.slot_size <= GC_BLOCK_SIZE;
+                     offset += slab.slot_size) {
+                    auto header = (GCHeader *)(block + offset);
+                    if (!header->live) continue;
+
+                    auto bytes = _size_of(header + 1, header->kind);
+                    heap_bytes += bytes;
+
+                    if (header->marked) {
+                        header->marked = false;
+                        live++;
+                        continue;
+                    }
+
+                    _free(header);
+                    objects_freed++;
+                    bytes_freed += bytes;
+                }
+            }
+        }
+
+        young.erase(std::remove_if(young.begin(), young.end(),
+                                   [](void *pointer) {
+                                       return !((GCHeader *)pointer - 1)->live;
+                                   }),
+                    young.end());
+
+        peak_bytes = std::max(peak_bytes, heap_bytes);
+        visited.clear();
+        collections++;
+        allocations = 0;
+        threshold = std::max(min_threshold, 2 * live);
+    }
+
+    /* Start a region for the allocations of a closure call. */
+    void open_region() { regions.push_back({sequence + 1, remembered.size()}); }
+
+    /* Leave a region without freeing anything, handing what was allocated in
+    it over to the enclosing region. */
+    void merge_region() { regions.pop_back(); }
+
+    /* Leave a region, freeing what can't be reached from the escaping value
+    or the values remembered while it was open. */
+    void close_region(LispVar escaping) {
+        auto region = regions.back();
+        regions.pop_back();
+        _sweep_region(region, &escaping, 1);
+    }
+
+    /* Get the number of allocations made since the innermost region was
+    opened. */
+    size_t region_allocations() { return sequence + 1 - regions.back().first; }
+
+    /* Free what was allocated in the innermost region and can't be reached
+    from `live` or the values remembered while it was open, and start the
+    region again. This is for a tail call, which takes over the call the
+    region was opened for. */
+    void renew_region(const std::vector<LispVar> &live) {
+        _sweep_region(regions.back(), live.data(), live.size());
+        regions.back() = {sequence + 1, remembered.size()};
+    }
+
+    /* Note that a value has been stored somewhere older than the current
+    region, so that it is kept when the region is closed. */
+    void remember(LispVar value) {
+        if (regions.empty()) return;
+        auto header = _header(_payload(value));
+        if (header && header->sequence) remembered.push_back(value);
+    }
+
+    /* Called before storing a value in a container. */
+    void write_barrier(void *container, LispVar value) {
+        if (regions.empty()) return;
+        auto header = _header(container);
+        if (!header || header->sequence < regions.back().first) remember(value);
+    }
+
+    void print_stats() {
+        size_t heap_bytes = 0;
+        for (size_t kind = 0; kind < GC_KINDS; kind++) {
+            auto &slab = slabs[kind];
+            for (auto block : slab.blocks) {
+                for (size_t offset = 0; offset + slab.slot_size <= GC_BLOCK_SIZE;
+                     offset += slab.slot_size) {
+                    auto header = (GCHeader *)(block + offset);
+                    if (header->live) {
+                        heap_bytes += _size_of(header + 1, header->kind);
+                    }
+                }
+            }
+        }
+        peak_bytes = std::max(peak_bytes, heap_bytes);
+
+        std::cerr << "[GC] Collections: " << collections << '\n'
+                  << "[GC] Objects freed: " << objects_freed << '\n'
+                  << "[GC] Objects freed on return: " << region_objects_freed
+                  << '\n'
+                  << "[GC] Bytes freed: " << bytes_freed << '\n'
+                  << "[GC] Peak heap: " << peak_bytes << " bytes\n";
+    }
+
+   private:
+    GCSlab slabs[GC_KINDS];
+    std::unordered_set<uintptr_t> blocks;
+    size_t sequence = 0;
+    std::vector<void *> young;  // Payloads in open regions, oldest first.
+    std::vector<LispVar> remembered;
+    std::unordered_set<void *> visited;  // Untracked payloads seen when marking.
+    std::vector<LispVar> pending;
+
+    static size_t _slot_size(size_t size) {
+        size_t slot = sizeof(GCHeader) + size;
+        return (slot + alignof(std::max_align_t) - 1) &
+               ~(alignof(std::max_align_t) - 1);
+    }
+
+    void *_take_slot(GCKind kind) {
+        auto &slab = slabs[kind];
+
+        if (!slab.free_slots.empty()) {
+            auto slot = slab.free_slots.back();
+            slab.free_slots.pop_back();
+            return slot;
+        }
+
+        if (slab.bump + slab.slot_size > slab.end) {
+            auto block = (char *)std::aligned_alloc(GC_BLOCK_SIZE, GC_BLOCK_SIZE);
+            if (!block) throw std::bad_alloc();
+            std::memset(block, 0, GC_BLOCK_SIZE);
+
+            slab.blocks.push_back(block);
+            blocks.insert((uintptr_t)block);
+            slab.bump = block;
+            slab.end = block + GC_BLOCK_SIZE;
+        }
+
+        auto slot = slab.bump;
+        slab.bump += slab.slot_size;
+        return slot;
+    }
+
+    /* The header of a payload, or a null pointer if it wasn't allocated with
+    `gc_new`. */
+    GCHeader *_header(void *payload) {
+        if (!payload) return nullptr;
+        auto block = (uintptr_t)payload & ~(uintptr_t)(GC_BLOCK_SIZE - 1);
+        if (!blocks.count(block)) return nullptr;
+        return (GCHeader *)payload - 1;
+    }
+
+    static void *_payload(LispVar value) { return value.heap_pointer(); }
+
+    void _push_children(LispVar item) {
+        if (item.tag() == VECTOR) {
+            for (auto child : *item.vector()) pending.push_back(child);
+        } else if (item.tag() == LIST) {
+            for (auto &child : *item.list()) pending.push_back(child);
+        } else if (item.tag() == EXPRESSION || item.tag() == CLOSURE) {
+            for (auto &child : item.tree()->nodes) pending.push_back(child);
+            _mark_compiled(item.tree());
+        }
+    }
+
+    /* Free what was allocated in a region which has been left or is about to
+    be started again, except what can be reached from the `count` values at
+    `live` or from the values remembered while it was open. */
+    void _sweep_region(GCRegion region, const LispVar *live, size_t count) {
+        auto first = std::lower_bound(young.begin(), young.end(), region.first,
+                                      [](void *pointer, size_t sequence) {
+                                          return ((GCHeader *)pointer - 1)
+                                                     ->sequence < sequence;
+                                      });
+        if (first == young.end() && remembered.size() == region.remembered) {
+            return;
+        }
+
+        for (size_t i = 0; i < count; i++) _trace_region(live[i], region.first);
+        for (size_t i = region.remembered; i < remembered.size(); i++) {
+            _trace_region(remembered[i], region.first);
+        }
+
+        // Whatever was reached is promoted, the rest is freed.
+        for (auto it = first; it != young.end(); it++) {
+            auto header = (GCHeader *)*it - 1;
+            if (header->marked) {
+                header->marked = false;
+                header->sequence = 0;
+                continue;
+            }
+
+            auto bytes = _size_of(*it, header->kind);
+            _free(header);
+            objects_freed++;
+            region_objects_freed++;
+            bytes_freed += bytes;
+            if (allocations) allocations--;
+        }
+        young.erase(first, young.end());
+
+        // Values from enclosing regions still have to be remembered.
+        auto kept = remembered.begin() + region.remembered;
+        for (auto it = kept; it != remembered.end(); it++) {
+            auto header = _header(_payload(*it));
+            if (header && header->sequence) *kept++ = *it;
+        }
+        remembered.erase(kept, remembered.end());
+    }
+
+    /* Mark what can be reached from a value without leaving a region. */
+    void _trace_region(LispVar value, size_t first) {
+        pending.push_back(value);
+
+        while (!pending.empty()) {
+            auto item = pending.back();
+            pending.pop_back();
+
+            auto header = _header(_payload(item));
+            if (!header || header->sequence < first || header->marked) continue;
+            header->marked = true;
+
+            // Compiled constants are nodes of the tree, captures of it or
+            // remembered.
+            if (item.tag() == VECTOR) {
+                for (auto child : *item.vector()) pending.push_back(child);
+            } else if (item.tag() == LIST) {
+                for (auto &child : *item.list()) pending.push_back(child);
+            } else if (item.tag() == EXPRESSION || item.tag() == CLOSURE) {
+                for (auto &child : item.tree()->nodes) pending.push_back(child);
+                _push_captures(item.tree(), pending);
+            }
+        }
+    }
+
+    /* Estimate the number of bytes used by an object. */
+    size_t _size_of(void *pointer, GCKind kind) {
+        if (kind == GC_STRING) {
+            auto string = (std::string *)pointer;
+            return sizeof(std::string) + string->capacity();
+        }
+        if (kind == GC_VECTOR) {
+            auto vector = (PersistentVector<LispVar> *)pointer;
+            return sizeof(PersistentVector<LispVar>) +
+                   vector->size() * sizeof(LispVar);
+        }
+        if (kind == GC_LIST) {
+            auto list = (std::deque<LispVar> *)pointer;
+            return sizeof(std::deque<LispVar>) + list->size() * sizeof(LispVar);
+        }
+        if (kind == GC_NUMBER) return sizeof(long);
+        auto tree = (Tree<LispVar> *)pointer;
+        return sizeof(Tree<LispVar>) + tree->nodes.capacity() * sizeof(LispVar) +
+               tree->depths.capacity() * sizeof(unsigned int);
+    }
+
+    void _free(GCHeader *header) {
+        void *pointer = header + 1;
+
+        if (header->kind == GC_STRING) {
+            ((std::string *)pointer)->~basic_string();
+        } else if (header->kind == GC_VECTOR) {
+            ((PersistentVector<LispVar> *)pointer)->~PersistentVector();
+        } else if (header->kind == GC_LIST) {
+            ((std::deque<LispVar> *)pointer)->~deque();
+        } else if (header->kind == GC_TREE) {
+            // Compiled code is looked up by the address of its tree, so it
+            // has to go before the address can be reused.
+            _forget_compiled((Tree<LispVar> *)pointer);
+            ((Tree<LispVar> *)pointer)->~Tree();
+        }
+
+        header->live = false;
+        header->marked = false;
+        slabs[header->kind].free_slots.push_back((char *)header);
+    }
+};
+
+GarbageCollector GC;
+
+/* Protects values which are only held by C++ code from being collected for as
+long as the root is in scope. */
+struct GCRoot {
+    GCRoot(LispVar *first, size_t count = 1) {
+        GC.roots.push_back({first, count});
+    }
+    ~GCRoot() { GC.roots.pop_back(); }
+};
+
+template <class T>
+T *gc_new() {
+    return GC.allocate<T>();
+}
@@ -1,10 +1,28 @@
 /* This code was automatically generated from `${filename.name}`. */
 #include <map>
+#include <vector>
 #include "./lispvar.h"
 
-std::map<std::string, LispVar *> BUILTINS_TYPES = {};
+// The signature of each builtin, indexed by `LispBuiltin`.
+LispVar *BUILTINS_TYPES[${len(SIGNATURES)}] = {};
 bool BUILTINS_TYPES_READY = false;
 
+// The same signatures compiled for checking arguments against.
+struct TypeSignature;
+TypeSignature *_compile_signature(LispVar expected);
+TypeSignature *BUILTINS_SIGNATURES[${len(SIGNATURES)}] = {};
+
+% for builtin in SIGNATURES:
+LispVar _builtin_${builtin}(std::vector<LispVar *> &args);
+% endfor
+
+// The implementation of each builtin, indexed by `LispBuiltin`.
+LispVar (*const BUILTIN_FUNCTIONS[])(std::vector<LispVar *> &) = {
+    % for builtin in SIGNATURES:
+    _builtin_${builtin},
+    % endfor
+};
+
 
 const std::map<LispType, const std::string> TYPENAMES {
     % for key, value in TYPES.items():
@@ -30,8 +48,13 @@ void _fill_out_lisp_builtin_types() {
     *type_${i} = parse_and_evaluate("${_escape(sign)}");
     % endfor
 
+    % for i, _ in enumerate(UNIQUE_SIGNATURES):
+    auto signature_${i} = _compile_signature(*type_${i});
+    % endfor
+
     % for builtin, (signature, *_) in SIGNATURES.items():
-    BUILTINS_TYPES["${builtin}"] = type_${UNIQUE_SIGNATURES.index(signature)};
+    BUILTINS_TYPES[${_builtin2enum(builtin)}] = type_${UNIQUE_SIGNATURES.index(signature)};
+    BUILTINS_SIGNATURES[${_builtin2enum(builtin)}] = signature_${UNIQUE_SIGNATURES.index(signature)};
     %endfor
 
     BUILTINS_TYPES_READY = true;
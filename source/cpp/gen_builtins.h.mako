@@ -1,7 +1,6 @@
 /* This code was automatically generated from `${filename.name}`. */
-#include <map>
 #include <string>
-#include <set>
+#include <vector>
 
 enum LispBuiltin {
     % for signature in SIGNATURES:
@@ -9,19 +8,8 @@ enum LispBuiltin {
     % endfor
 };
 
-const std::map<LispBuiltin, std::string> BUILTINS_NAMES = {
-    % for signature in SIGNATURES:
-    {${_builtin2enum(signature)}, ${f'"{signature}"'}},
-    % endfor
-};
-
-const std::map<std::string, LispBuiltin> BUILTINS_NUMS = {
-    % for signature in SIGNATURES:
-    {${f'"{signature}"'}, ${_builtin2enum(signature)}},
-    % endfor
-};
-
-const std::set<std::string> LISP_BUILTINS = {
+// Indexed by `LispBuiltin`.
+const std::vector<std::string> BUILTINS_NAMES = {
     % for signature in SIGNATURES:
     ${f'"{signature}"'},
     % endfor
@@ -1,8 +1,12 @@
 #include <math.h>
 
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
 #include <chrono>
+#include <climits>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
@@ -11,35 +15,27 @@
 #include <map>
 #include <numeric>
 #include <random>
-#include <regex>
 #include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "./command.h"
 #include "./num.h"
+#include "./regex_cache.h"
 #include "./scoping.h"
 #include "./vecex.h"
+#include "./vm.h"
 
 bool DEBUG_MODE;
 bool SAFE_MODE;
+bool VM_MODE;
 // LispVar[1024] ARGS_BUFFER;
 
 std::mt19937 RNG;
 
-struct LispEarlyReturn : public std::exception {
-    LispVar value;
-    const char *what() const throw() {
-        return "Uncaught LispEarlyReturn exception";
-    }
-};
-
-struct LispBreak : public std::exception {
-    const char *what() const throw() { return "Uncaught LispBreak exception"; }
-};
-
 /* Assert that a condition is truthy, or print an error message and exit. */
 void _lisp_assert_or_exit(bool condition, std::string message) {
     if (!condition) {
@@ -71,40 +67,43 @@ void _lisp_assert_or_exit(bool condition, std::string message) {
     exit(1);
 }
 
-VariableScope<LispVar> VARIABLE_SCOPE = {{}, 0};
+VariableScope<LispVar> VARIABLE_SCOPE = {{}, {}, 0};
 
 std::string LispVar::to_str() {
     uint size;
     std::stringstream ss;
 
-    if (this->tag == BUILTIN) {
-        ss << "<Builtin '" << BUILTINS_NAMES.at(this->builtin) << "'>";
-    } else if (this->tag == VARIABLE) {
-        ss << "<Variable '" << *(this->string) << "'>";
-    } else if (this->tag == TYPE) {
-        ss << "<Type '" << TYPENAMES.at(this->type) << "'>";
-    } else if (this->tag == EXPRESSION || this->tag == CLOSURE) {
+    if (this->tag() == BUILTIN) {
+        ss << "<Builtin '" << BUILTINS_NAMES.at(this->builtin()) << "'>";
+    } else if (this->tag() == VARIABLE) {
+        ss << "<Variable '" << SYMBOLS.name(this->slot()) << "'>";
+    } else if (this->tag() == TYPE) {
+        ss << "<Type '" << TYPENAMES.at(this->type()) << "'>";
+    } else if (this->tag() == REGEX) {
+        ss << "<Regex " << escape_string(REGEXES.patterns[this->regex_id()])
+           << ">";
+    } else if (this->tag() == EXPRESSION || this->tag() == CLOSURE) {
         ss << this->_pretty_tree();
-    } else if (this->tag == NUM || this->tag == FLOAT)
+    } else if (this->tag() == NUM || this->tag() == FLOAT)
         ss << PNUMPART(this);
-    else if (this->tag == NIL)
+    else if (this->tag() == NIL)
         ss << "Nil";
-    else if (this->tag == __NO_ARGS__)
+    else if (this->tag() == __NO_ARGS__)
         ss << "<Special token '__NO_ARGS__'>";
-    else if (this->tag == BOOL) {
-        ss << (this->num ? "Yes" : "No");
-    } else if (this->tag == STRING) {
-        ss << *(this->string);
-    } else if (this->tag == VECTOR) {
-        size = this->vector->size();
+    else if (this->tag() == BOOL) {
+        ss << (this->num() ? "Yes" : "No");
+    } else if (this->tag() == STRING) {
+        ss << *(this->string());
+    } else if (this->tag() == VECTOR) {
+        size = this->vector()->size();
         ss << "[";
         for (size_t i = 0; i < size; i++) {
-            ss << (*this->vector)[i].to_repr();
+            ss << (*this->vector())[i].to_repr();
             if (i != (size - 1)) { ss << " "; }
         }
         ss << "]";
-    } else if (this->tag == LIST) {
-        size = this->list->size();
+    } else if (this->tag() == LIST) {
+        size = this->list()->size();
         ss << "<";
         for (size_t i = 0; i < size; i++) {
             ss << (*this)[i].to_repr();
@@ -112,10 +111,10 @@ std::string LispVar::to_str() {
         }
         ss << ">";
     } else {
-        if (!TYPENAMES.count(this->tag)) {
-            std::cout << "Error: Tag " << this->tag << " not in TYPENAMES.\n";
+        if (!TYPENAMES.count(this->tag())) {
+            std::cout << "Error: Tag " << this->tag() << " not in TYPENAMES.\n";
         } else {
-            _throw_does_not_implement(this->tag, "to_str");
+            _throw_does_not_implement(this->tag(), "to_str");
         }
         exit(1);
     }
@@ -125,30 +124,32 @@ std::string LispVar::to_str() {
 std::string LispVar::get_help_str() {
     std::stringstream ss;
 
-    if (this->tag == BUILTIN) {
-        ss << "builtin '" << BUILTINS_NAMES.at(this->builtin)
+    if (this->tag() == BUILTIN) {
+        ss << "builtin '" << BUILTINS_NAMES.at(this->builtin())
            << "' with signature "
-           << BUILTINS_TYPES[BUILTINS_NAMES.at(this->builtin)]->to_str();
-    } else if (this->tag == TYPE) {
+           << BUILTINS_TYPES[this->builtin()]->to_str();
+    } else if (this->tag() == TYPE) {
         return "a type";
-    } else if (this->tag == EXPRESSION) {
+    } else if (this->tag() == EXPRESSION) {
         return "an expression";
-    } else if (this->tag == NUM)
+    } else if (this->tag() == REGEX) {
+        return "a compiled regular expression";
+    } else if (this->tag() == NUM)
         return "a number";
-    else if (this->tag == NIL)
+    else if (this->tag() == NIL)
         return "nothing";
-    else if (this->tag == BOOL) {
+    else if (this->tag() == BOOL) {
         return "either Yes or No";
-    } else if (this->tag == STRING) {
+    } else if (this->tag() == STRING) {
         return "a string of characters";
-    } else if (this->tag == VECTOR) {
+    } else if (this->tag() == VECTOR) {
         return "a vector of items";
     } else {
-        if (!TYPENAMES.count(this->tag)) {
-            std::cout << "Error: Tag " << this->tag << " not in TYPENAMES.\n"
+        if (!TYPENAMES.count(this->tag())) {
+            std::cout << "Error: Tag " << this->tag() << " not in TYPENAMES.\n"
                       << '\n';
         } else
-            _throw_does_not_implement(this->tag, "get_help_str");
+            _throw_does_not_implement(this->tag(), "get_help_str");
         exit(1);
     }
     return ss.str();
@@ -156,29 +157,49 @@ std::string LispVar::get_help_str() {
 
 LispVar call_builtin(LispVar operation, std::vector<LispVar *> args);
 LispVar call_closure(LispVar operation, std::vector<LispVar *> args);
-LispVar evaluate_const(std::string item);
+LispVar evaluate_const(const std::string &item);
 LispVar parse_expression(std::string expression);
 
 // ===| BUILTINS |===
-LispVar evaluate_expression(LispVar *expression, uint index = 1);
+LispVar evaluate_expression(LispVar *expression, uint index);
+LispVar evaluate(LispVar *expression, uint index = 1);
+
+// Classes of characters, as far as splitting tokens is concerned.
+enum LexClass : uint8_t { LEX_OTHER, LEX_OPEN, LEX_CLOSE, LEX_SPACE };
+
+/* Get the class of every character. */
+std::array<LexClass, 256> _make_lex_classes() {
+    std::array<LexClass, 256> classes;
+    for (int c = 0; c < 256; c++) {
+        classes[c] = isspace(c) ? LEX_SPACE : LEX_OTHER;
+    }
+    for (unsigned char c : std::string("([{")) classes[c] = LEX_OPEN;
+    for (unsigned char c : std::string(")]}")) classes[c] = LEX_CLOSE;
+    return classes;
+}
+
+const std::array<LexClass, 256> LEX_CLASSES = _make_lex_classes();
 
-/* Parse a Lisp expression into a tree. */
+/* Parse a Lisp expression into a tree.
+
+This makes a single pass over the characters. Tokens are looked up where they
+are in the expression instead of being built up a character at a time, and
+each node goes straight into the tree. A __NO_ARGS__ token is put after the
+name of every call, and replaced by the next node if that turns out to be an
+argument. */
 LispVar parse_expression(std::string expression) {
     auto ast = new Tree<LispVar>;
-    *ast = {{*_SINGLETON_NOT_SET}, {0}};
-
     LispVar output;
-    output.tag = EXPRESSION;
-    output.tree = ast;
+    output.set_tree(EXPRESSION, ast);
 
     const auto size = expression.size();
-    const std::string incr_depth = "([{";
-    const std::string decr_depth = "}])";
-    const auto npos = std::string::npos;
+    const auto text = expression.data();
+    const std::string expression_token = "expression";
+    const std::string vector_token = "vector";
 
-    uint tree_length = 1;
     uint depth = 0;
-    int depth_buffer;
+    uint end_depth = 0;  // The depth after the last token.
+    unsigned int depth_buffer = 0;  // The depth of the current token.
     int d_depth;  // Depth difference
 
     bool last_is_empty;
@@ -187,15 +208,20 @@ LispVar parse_expression(std::string expression) {
     bool last_was_paren = false;
     bool last_was_paren_buffer = false;  // One token behind.
     bool line_is_comment = false;
+    bool ends_with_no_args = false;
 
     char character;
 
-    std::string string_buffer;
+    // The current token is text[token_start:token_end], which is empty when
+    // they are equal.
+    size_t token_start = 0;
+    size_t token_end = 0;
+    std::string token;
 
     for (size_t i = 0; i < size; i++) {
-        character = expression[i];
-        d_depth = (incr_depth.find(character) != npos) -
-                  (decr_depth.find(character) != npos);
+        character = text[i];
+        auto lex_class = LEX_CLASSES[(unsigned char)character];
+        d_depth = (lex_class == LEX_OPEN) - (lex_class == LEX_CLOSE);
         last_was_paren = last_was_paren || (d_depth > 0);
         depth += d_depth;
 
@@ -212,40 +238,42 @@ LispVar parse_expression(std::string expression) {
         line_is_comment = (line_is_comment && character != '\n') |
                           (!in_string_literal && character == ';');
 
-        last_is_empty = string_buffer.empty();
+        last_is_empty = token_start == token_end;
 
         // Finish the current token on whitespace or parentheses outside
         // Q-expressions.
         if (!in_string_literal &&
-            (line_is_comment || isspace(character) || d_depth)) {
-            if (character == '{') {
-                string_buffer += "expression";
-                if (last_is_empty) depth_buffer = depth;
-                last_is_empty = 0;
-                last_was_paren = 0;
-            }
+            (line_is_comment || lex_class == LEX_SPACE || d_depth)) {
+            const std::string *keyword = nullptr;
+            if (character == '{') keyword = &expression_token;
+            if (character == '[') keyword = &vector_token;
 
-            if (character == '[') {
-                string_buffer += "vector";
+            if (keyword) {
                 if (last_is_empty) depth_buffer = depth;
-                last_is_empty = 0;
                 last_was_paren = 0;
             }
 
-            if (!last_is_empty) {
-                ast->nodes[tree_length - 1] = evaluate_const(string_buffer);
-                ast->depths[tree_length - 1] = depth_buffer;
+            if (!last_is_empty || keyword) {
+                token.assign(text + token_start, token_end - token_start);
+                if (keyword) token += *keyword;
+
+                // A __NO_ARGS__ token at the same depth is followed by an
+                // argument, so it isn't needed.
+                if (ends_with_no_args && ast->depths.back() == depth_buffer) {
+                    ast->nodes.pop_back();
+                    ast->depths.pop_back();
+                }
+                ast->nodes.push_back(evaluate_const(token));
+                ast->depths.push_back(depth_buffer);
 
+                ends_with_no_args = last_was_paren_buffer;
                 if (last_was_paren_buffer) {
                     ast->nodes.push_back(*_SINGLETON_NOARGS_TOKEN);
-                    ast->depths.push_back(ast->depths[tree_length - 1] + 1);
-                    tree_length++;
+                    ast->depths.push_back(depth_buffer + 1);
                 }
 
-                string_buffer = "";
-                ast->depths.push_back(depth);
-                ast->nodes.push_back(*_SINGLETON_NOT_SET);
-                tree_length++;
+                end_depth = depth;
+                token_start = token_end = 0;
                 last_was_paren_buffer = 0;
                 last_was_paren = 0;
             }
@@ -254,10 +282,13 @@ LispVar parse_expression(std::string expression) {
 
         escape_next = !escape_next && (character == '\\');
 
-        if (last_is_empty) depth_buffer = depth + !last_was_paren;
+        if (last_is_empty) {
+            depth_buffer = depth + !last_was_paren;
+            token_start = i;
+        }
 
         // Add to the current token.
-        string_buffer.push_back(character);
+        token_end = i + 1;
         last_was_paren = false;
     }
 
@@ -266,25 +297,10 @@ LispVar parse_expression(std::string expression) {
                                  "' does not have balanced parentheses!");
     }
 
-    if (ast->nodes[tree_length - 1] == *_SINGLETON_NOT_SET) {
-        ast->depths.pop_back();
+    if (ends_with_no_args && ast->depths.back() == end_depth) {
         ast->nodes.pop_back();
+        ast->depths.pop_back();
     }
-
-    auto new_tree = new Tree<LispVar>;
-
-    // Removes the __NO_ARGS__ tokens from the stream
-    // if they aren't necessary.
-    for (size_t i = 0; (i + 1) < tree_length; i++) {
-        if (ast->nodes[i] == *_SINGLETON_NOARGS_TOKEN) {
-            if (ast->depths[i] == ast->depths[i + 1]) continue;
-        }
-        new_tree->nodes.push_back(ast->nodes[i]);
-        new_tree->depths.push_back(ast->depths[i]);
-    }
-
-    output.tree = new_tree;
-    delete ast;
     return output;
 }
 
@@ -298,77 +314,54 @@ bool _type_leq(LispType constant, LispVar *lesser) {
     if (constant == FALSY) { return !lesser->truthiness(); }
     if (constant == ITERABLE) { return lesser->is_sized(); }
     if (constant == INDEXABLE) {
-        return lesser->tag == LIST || lesser->tag == VECTOR;
+        return lesser->tag() == LIST || lesser->tag() == VECTOR;
     }
     if (constant == NUMERIC) { return lesser->is_numeric(); }
-    return constant == lesser->tag;
+    if (constant == PATTERN) {
+        return lesser->tag() == STRING || lesser->tag() == REGEX;
+    }
+    return constant == lesser->tag();
 }
 
-// warning this leaks
-/* Matches a vector of LispVars against a LispVar VECTOR containing TYPEs.
-
-Allowed sub-sub-values of `expected`
-====================================
-- truthy: (bool arg)
-- falsy: (! (bool arg))
-- iterable: Arg is String or Q-expression.
-- numeric: Arg is Num, Bool, or Nothing.
-- any: Any type. Omitting this changes nothing - it's only used for
-readability.
-- (typename): The specific type.
-- *: Matches argument repeatedly.
-- +: Matches argument at least once.
-
-*/
-bool _types_match(std::vector<LispVar *> args, LispVar expected) {
-    std::string str_l = "vector";
-    std::string str_t = "type";
-    LispVar l;
-    l.tag = TYPE;
-    l.string = &str_l;
-
-    LispVar t;
-    t.tag = TYPE;
-    t.string = &str_t;
-
-    // Type check the type input.
-    if (expected.tag != VECTOR) _throw_could_not_cast(l, expected);
-    for (auto pattern : *expected.vector) {
-        if (pattern.tag != VECTOR) _throw_could_not_cast(l, pattern);
-        for (auto type : (*pattern.vector)) {
-            if (type.tag != TYPE) _throw_could_not_cast(t, type);
-        }
-    }
+using TypeProgram = vecex::Program<LispType>;
 
-    using Left = LispType;    // Comparison object.
-    using Right = LispVar *;  // Target object.
+// Keyed by the types of each pattern, each followed by __NOT_SET__.
+std::map<std::vector<LispType>, TypeProgram *> TYPE_PROGRAMS;
 
-    vecex::Token<Left> top_node = {vecex::JUST};
+/* Build a vecex program for the types of a signature, given as they are kept
+in TYPE_PROGRAMS. */
+TypeProgram *_compile_types(const std::vector<LispType> &types) {
+    vecex::Token<LispType> top_node = {vecex::JUST};
+    std::vector<vecex::Token<LispType> *> owned_tokens;
     std::optional<std::pair<vecex::uint_inf, vecex::uint_inf>> repeats;
 
-    // Parse the LispVars and construct a vecex tree.
-    for (auto child_0 : *expected.vector) {
-        auto inner_token = new vecex::Token<Left>;
+    // Construct a vecex tree from the types.
+    auto type = types.begin();
+    while (type != types.end()) {
+        auto inner_token = new vecex::Token<LispType>;
         *inner_token = {vecex::INTERSECTION, {}};
+        owned_tokens.push_back(inner_token);
         repeats = {};
 
-        for (auto child_1 : *child_0.vector) {
-            if (child_1.type == STAR) {
+        for (; *type != __NOT_SET__; type++) {
+            if (*type == STAR) {
                 repeats = {{0, false}, {0, true}};
-            } else if (child_1.type == PLUS) {
+            } else if (*type == PLUS) {
                 repeats = {{1, false}, {0, true}};
-            } else if (child_1.type == QMARK) {
+            } else if (*type == QMARK) {
                 repeats = {{0, false}, {1, false}};
             } else {
-                inner_token->tokens.push_back(child_1.type);
+                inner_token->tokens.push_back(*type);
             }
         }
+        type++;
 
         // Wrap the token inside another one if it has been repeated.
         if (repeats.has_value()) {
             auto nums = repeats.value();
-            auto wrapper_token = new vecex::Token<Left>;
+            auto wrapper_token = new vecex::Token<LispType>;
             *wrapper_token = {vecex::BETWEEN, {inner_token}};
+            owned_tokens.push_back(wrapper_token);
             wrapper_token->min = nums.first;
             wrapper_token->max = nums.second;
             top_node.tokens.push_back(wrapper_token);
@@ -377,828 +370,1577 @@ bool _types_match(std::vector<LispVar *> args, LispVar expected) {
         }
     }
 
-    vecex::Comparer<Left, Right> matches = _type_leq;
-    auto match = vecex::fullmatch(&top_node, &args, &matches);
-    // std::cout << match.has_value() << '\n';
-    // std::cout << expected.to_str() << '\n';
-    // exit(1);
-    return match.has_value();
-}
-
-LispVar call_variable(LispVar variable, std::vector<LispVar *> args) {
-    if (variable.tag == BUILTIN) { return call_builtin(variable, args); }
-    if (variable.tag == CLOSURE) { return call_closure(variable, args); }
-
-    assert(false);
+    auto program = new TypeProgram(&top_node);
+    for (auto token : owned_tokens) delete token;
+    return program;
 }
 
-/* Call a closure on the inputs. */
-LispVar call_closure(LispVar closure, std::vector<LispVar *> arguments) {
-    assert(closure.tag == CLOSURE);
-
-    // Function example: {{n} (+ n 10)}
-    // The first branch is the arguments the function takes.
-    // The second is an expression to execute.
-
-    // Calling a function should first increase the scope depth.
-    VARIABLE_SCOPE.increment();
-    assert(VARIABLE_SCOPE.depth < 2048);
+/* Matches a vector of LispVars against a LispVar VECTOR containing TYPEs.
 
-    // Then it should call (let argname arg) to bind the arguments
-    // to the function values.
-    auto argument_names = closure.tree->subtree(1);
-    uint arity = argument_names.size() - 1;
+Allowed sub-sub-values of `expected`
+====================================
+- truthy: (bool arg)
+- falsy: (! (bool arg))
+- iterable: Arg is String or Q-expression.
+- numeric: Arg is Num, Bool, or Nothing.
+- pattern: Arg is a String or a Regex.
+- any: Any type. Omitting this changes nothing - it's only used for
+readability.
+- (typename): The specific type.
+- *: Matches argument repeatedly.
+- +: Matches argument at least once.
+- ?: Matches argument at most once.
 
-    assert(arity == arguments.size());
+Repeated arguments match as many times as they can while still letting the
+rest of the arguments match.
+*/
+bool _types_match(std::vector<LispVar *> &args, LispVar expected) {
+    LispVar l = {TYPE, VECTOR};
+    LispVar t = {TYPE, TYPE};
 
-    // Offset for the arity + 1 (base tree index)
-    auto function_steps = closure.tree->subtree(arity + 2);
-    for (size_t i = 1; i <= arity; i++) {
-        auto a = argument_names.nodes[i];
-        auto b = arguments[i - 1];
-        VARIABLE_SCOPE.set_var(a.string, *b);
+    // Type check the type input.
+    if (expected.tag() != VECTOR) _throw_could_not_cast(l, expected);
+    static std::vector<LispType> types;
+    types.clear();
+    for (auto pattern : *expected.vector()) {
+        if (pattern.tag() != VECTOR) _throw_could_not_cast(l, pattern);
+        for (auto type : *pattern.vector()) {
+            if (type.tag() != TYPE) _throw_could_not_cast(t, type);
+            types.push_back(type.type());
+        }
+        types.push_back(__NOT_SET__);
     }
 
-    // Then, it should evaluate the function.
-    auto callable = new LispVar;
-    auto ptr = new Tree<LispVar>;
-    *ptr = function_steps;
-
-    callable->tree = ptr;
-    callable->tag = EXPRESSION;
+    // The same signatures tend to be checked over and over.
+    auto pos = TYPE_PROGRAMS.find(types);
+    if (pos == TYPE_PROGRAMS.end()) {
+        pos = TYPE_PROGRAMS.emplace(types, _compile_types(types)).first;
+    }
+    auto program = pos->second;
 
-    LispVar result;
+    vecex::Comparer<LispType, LispVar *> matches = _type_leq;
+    return program->fullmatch(&args, &matches).has_value();
+}
 
-    try {
-        result = evaluate_expression(callable, 0);
-    } catch (LispEarlyReturn &value_exception) {
-        result = value_exception.value;
-    }
+/* One argument of a compiled type signature. */
+struct TypePattern {
+    uint32_t tags = ~0u;  // Bit `t` is set if LispType `t` is accepted.
+    bool truthy = false;
+    bool falsy = false;
+    unsigned int min = 1;  // Least number of times the pattern is repeated.
+    unsigned int max = 1;  // Most number of times, or UINT_MAX.
 
-    delete callable;
+    bool accepts(LispVar *value);
+};
 
-    // If the result is another closure, the local variables need to be
-    // evaluated before the closure is returned to the outer scope. Otherwise,
-    // the name resolution would fail since the locals have gone out of scope.
+/* A type signature of a builtin. */
+struct TypeSignature {
+    std::vector<TypePattern> patterns;
+    bool repeats = false;  // Whether or not any pattern can be repeated.
 
-    if (result.tag == CLOSURE) {
-        std::set<std::string> variables_set_in_this_scope;
+    bool matches(std::vector<LispVar *> &args);
+};
 
-        for (auto item : VARIABLE_SCOPE.scopes) {
-            auto item_max_depth = item.second.front().depth;
-            if (item_max_depth == VARIABLE_SCOPE.depth) {
-                variables_set_in_this_scope.insert(item.first);
-            }
-        }
-        std::vector<LispVar> new_nodes;
+/* Get the set of runtime types accepted by a type, as bits indexed by
+`LispType`. */
+uint32_t _type_mask(LispType type) {
+    const uint32_t sized = 1 << STRING | 1 << VECTOR | 1 << LIST |
+                           1 << EXPRESSION | 1 << CLOSURE;
+
+    if (type == ANY || type == TRUTHY || type == FALSY) return ~0u;
+    if (type == CALLABLE) return 1 << BUILTIN | 1 << CLOSURE;
+    if (type == BOOLY) return 1 << NUM | 1 << NIL | 1 << BOOL | sized;
+    if (type == ITERABLE) return sized;
+    if (type == INDEXABLE) return 1 << LIST | 1 << VECTOR;
+    if (type == NUMERIC) return 1 << NUM | 1 << BOOL | 1 << FLOAT;
+    if (type == PATTERN) return 1 << STRING | 1 << REGEX;
+    return 1 << type;
+}
 
-        for (auto node : result.tree->nodes) {
-            if (node.tag == VARIABLE &&
-                variables_set_in_this_scope.find(*node.string) !=
-                    variables_set_in_this_scope.end()) {
-                new_nodes.push_back(VARIABLE_SCOPE.get_var(node.string));
+/* Compile a signature like the ones `_types_match` takes, so that it can be
+checked against arguments without building a vecex tree each time. */
+TypeSignature *_compile_signature(LispVar expected) {
+    LispVar l = {TYPE, VECTOR};
+    LispVar t = {TYPE, TYPE};
+
+    if (expected.tag() != VECTOR) _throw_could_not_cast(l, expected);
+
+    auto signature = new TypeSignature;
+    for (auto pattern : *expected.vector()) {
+        if (pattern.tag() != VECTOR) _throw_could_not_cast(l, pattern);
+
+        TypePattern compiled;
+        for (auto type : *pattern.vector()) {
+            if (type.tag() != TYPE) _throw_could_not_cast(t, type);
+
+            if (type.type() == STAR) {
+                compiled.min = 0;
+                compiled.max = UINT_MAX;
+            } else if (type.type() == PLUS) {
+                compiled.min = 1;
+                compiled.max = UINT_MAX;
+            } else if (type.type() == QMARK) {
+                compiled.min = 0;
+                compiled.max = 1;
             } else {
-                new_nodes.push_back(node);
+                compiled.tags &= _type_mask(type.type());
+                compiled.truthy |= type.type() == TRUTHY;
+                compiled.falsy |= type.type() == FALSY;
             }
         }
 
-        result.tree->nodes = new_nodes;
+        signature->repeats |= compiled.min != 1 || compiled.max != 1;
+        signature->patterns.push_back(compiled);
     }
-
-    // If it is a closure, it can get information from the surrounding
-    // scope. If it is a pure function, it can't. This should be checked and
-    // enforced by the Python code.
-
-    // Finally, the scope should be exited and cleaned up.
-    VARIABLE_SCOPE.decrement();
-    return result;
+    return signature;
 }
 
-/* Perform an operation on the inputs. */
-LispVar call_builtin(LispVar operation, std::vector<LispVar *> args) {
-    assert(operation.tag == BUILTIN);
-
-    LispVar output;
-    auto arity = args.size();
-
-    // Set the kind to be the type of all arguments, if they are the same.
-    LispType kind = arity ? args[0]->tag : __NOT_SET__;
-    for (size_t i = 1; i < arity; i++) {
-        kind = args[i]->tag == kind ? kind : __NOT_SET__;
-    }
-
-    auto op = operation.builtin;
-    auto name = BUILTINS_NAMES.at(op);
-    if (arity == 1 && *args[0] == *_SINGLETON_NOARGS_TOKEN) args = {};
+bool TypePattern::accepts(LispVar *value) {
+    if (!(tags >> value->tag() & 1)) return false;
+    if (truthy && !value->truthiness()) return false;
+    if (falsy && value->truthiness()) return false;
+    return true;
+}
 
-    // Typecheck the arguments.
-    if (BUILTINS_TYPES_READY && SAFE_MODE) {
-        if (!BUILTINS_TYPES.count(name)) {
-            std::cout << "[bug] Operation '" << op
-                      << "' is not typed. Exiting.\n";
-            exit(1);
+/* Match arguments against a signature. Unlike `_types_match`, repeated
+patterns are matched greedily, without backtracking, which is all the
+signatures of the builtins need. */
+bool TypeSignature::matches(std::vector<LispVar *> &args) {
+    auto n_args = args.size();
+
+    // Most signatures take a fixed number of arguments.
+    if (!repeats) {
+        if (n_args != patterns.size()) return false;
+        for (size_t i = 0; i < n_args; i++) {
+            if (!patterns[i].accepts(args[i])) return false;
         }
-        auto arg_types_match = _types_match(args, *BUILTINS_TYPES.at(name));
-        if (!arg_types_match) {
-            LispVar actual_type;
-            actual_type.tag = VECTOR;
-            actual_type.vector = new std::vector<LispVar>;
-            for (auto arg : args) { actual_type.vector->push_back(*arg); }
+        return true;
+    }
 
-            _throw_could_not_cast(
-                *BUILTINS_TYPES.at(name), actual_type, operation);
+    size_t i = 0;
+    for (auto &pattern : patterns) {
+        unsigned int count = 0;
+        while (i < n_args && count < pattern.max &&
+               pattern.accepts(args[i])) {
+            i++;
+            count++;
         }
+        if (count < pattern.min) return false;
     }
+    return i == n_args;
+}
 
-    if (op == B_PARSE) {
-        output = evaluate_const(*args[0]->string);
-        return output;
-    }
+[[noreturn]] void _throw_cannot_bind(const std::string &name) {
+    std::cout << "[BindingError] Cannot rebind builtin `" << name << "`.";
+    exit(1);
+}
 
-    // No operation.
-    if (op == B_DO) { return arity ? *args[arity - 1] : *_SINGLETON_NIL; }
-    if (op == B_CALL) {
-        return call_variable(*args[0], {args.begin() + 1, args.end()});
+/* Get the slot of the variable named by a VARIABLE or a STRING. The names of
+builtins always read as the builtins, so they can't be bound. */
+unsigned int _slot_of(LispVar name) {
+    if (name.tag() == VARIABLE) return name.slot();
+    if (name.tag() == BUILTIN) {
+        _throw_cannot_bind(BUILTINS_NAMES[name.builtin()]);
     }
 
-    if (op == B_APPLY) {
-        std::vector<LispVar *> new_args;
-        size_t nargs = args[1]->vector->size();
-        for (size_t i = 0; i < nargs; i++) {
-            new_args.push_back(&(*args[1]->vector)[i]);
-        }
-        return call_variable(*args[0], new_args);
-    }
-    if (op == B_EXIT) { exit(arity ? args[0]->num : 0); }
-    if (op == B_WHILE) {
-        int count = 0;
-        while (evaluate_expression(args[0]).truthiness()) {
-            try {
-                evaluate_expression(args[1]);
-            } catch (LispBreak &_) { break; }
+    auto slot = VARIABLE_SCOPE.resolve(*name.string());
+    if (slot < BUILTINS_NAMES.size()) _throw_cannot_bind(*name.string());
+    return slot;
+}
 
-            count++;
-            if (count > 100000) {
-                std::cout << "Infinite loop!" << '\n';
-                exit(1);
-            }
-        }
-        return *_SINGLETON_NIL;
-    }
-    // Break out of a loop.
-    if (op == B_BREAK) {
-        LispBreak exception;
-        throw exception;
-        return *_SINGLETON_NIL;
+/* Call a builtin or a closure, leaving a `break` out of the closure pending
+for the caller. */
+LispVar _call_variable(LispVar variable, std::vector<LispVar *> args) {
+    if (variable.tag() == BUILTIN) { return call_builtin(variable, args); }
+    if (variable.tag() == CLOSURE) {
+        if (VM_MODE) return VIRTUAL_MACHINE.call_closure(variable, args);
+        return call_closure(variable, args);
     }
 
-    if (op == B_SEED) {
-        RNG = std::mt19937(args[0]->num);
-        return *_SINGLETON_NIL;
-    }
+    assert(false);
+}
 
-    if (op == B_RETURN) {
-        LispEarlyReturn early_return;
-        early_return.value = *args[0];
-        throw early_return;
-        return *_SINGLETON_NIL;
-    }
+/* Call a builtin or a closure from a builtin, which can't pass signals on. */
+LispVar call_variable(LispVar variable, std::vector<LispVar *> args) {
+    auto result = _call_variable(variable, args);
+    if (PENDING_SIGNAL) raise_signal();
+    return result;
+}
 
-    // Generate a vector of random numbers.
-    if (op == B_RAND) {
-        output.vector = new std::vector<LispVar>;
-        for (int i = 0; i < args[0]->num; i++) {
-            // Using the mod here fixes the casting.
-            long num = RNG() % (1 << 16);
-            output.vector->push_back({NUM, num});
+/* If a closure is returned, the local variables need to be evaluated before it
+is returned to the outer scope. Otherwise, the name resolution would fail since
+the locals have gone out of scope. */
+void _capture_locals(LispVar *closure) {
+    if (closure->tag() != CLOSURE) return;
+
+    auto locals = VARIABLE_SCOPE.local_slots();
+    std::set<unsigned int> variables_set_in_this_scope(locals.begin(),
+                                                       locals.end());
+
+    // The tree may be shared with other closures or compiled bytecode, so
+    // the values are put into a copy.
+    auto captured = gc_new<Tree<LispVar>>();
+    *captured = *closure->tree();
+
+    for (auto &node : captured->nodes) {
+        if (node.tag() == VARIABLE &&
+            variables_set_in_this_scope.find(node.slot()) !=
+                variables_set_in_this_scope.end()) {
+            node = VARIABLE_SCOPE.get_var(node.slot());
         }
-        output.tag = VECTOR;
-        return output;
     }
 
-    // Bind a string to a variable value.
-    if (op == B_LET) {
-        VARIABLE_SCOPE.set_var(args[0]->string, *args[1]);
-        return *_SINGLETON_NIL;
-    }
+    closure->set_tree(CLOSURE, captured);
+}
 
-    if ((op == B_MATCH) | (op == B_FINDALL) | (op == B_SPLIT)) {
-        std::regex txt_regex;
-        try {
-            txt_regex = std::regex(*args[0]->string);
-        } catch (std::regex_error const &) {
-            std::cout << "RegexError: " << args[0]->to_repr()
-                      << " is an invalid regular expression.\n";
-            exit(1);
-        }
-        // Return whether or not an expression matches.
-        if (op == B_MATCH) {
-            output.tag = BOOL;
-            output.num = std::regex_match(*args[1]->string, txt_regex);
-            return output;
-        }
+/* A call to a closure which is left to whoever evaluated the body it was in,
+so that it can be made without another C++ stack frame. */
+struct TailCall {
+    LispVar callee;
+    std::vector<LispVar> arguments;
+};
 
-        if ((op == B_SPLIT) | (op == B_FINDALL)) {
-            // Get a token iterator which finds the groups.
-            // -1 is for split and 0 for the first capture group.
-            std::regex_token_iterator<std::string::iterator> rend;
-            std::regex_token_iterator<std::string::iterator> iter(
-                args[1]->string->begin(),
-                args[1]->string->end(),
-                txt_regex,
-                (op == B_SPLIT) ? -1 : 0);
-
-            output.vector = new std::vector<LispVar>;
-            output.tag = VECTOR;
-
-            // Push all matches into the vector.
-            while (iter != rend) {
-                LispVar var;
-                var.string = new std::string;
-                var.tag = STRING;
-
-                *var.string = (*iter++);
-                output.vector->push_back(var);
+/* Evaluate the body of a closure, except for a call to a closure in tail
+position, which is put in `call` instead of being made.
+
+The tail positions are the body itself, the last form of a `do`, both branches
+of an `if!` and the value of a `return`. A `?` evaluates both branches before
+picking one, so neither of them is in tail position. */
+LispVar _evaluate_tail(LispVar body, uint index, TailCall *call) {
+    GCRoot body_root(&body);
+    call->callee = *_SINGLETON_NIL;
+
+    while (true) {
+        auto tree = body.tree();
+        auto item = tree->nodes[index];
+        auto children = tree->children(index);
+        bool no_args = children.size() == 1 &&
+                       tree->nodes[children[0]].tag() == __NO_ARGS__;
+
+        if (item.tag() == BUILTIN && !children.empty() && !no_args) {
+            auto op = item.builtin();
+
+            if (op == B_DO) {
+                for (size_t i = 0; i + 1 < children.size(); i++) {
+                    evaluate_expression(&body, children[i]);
+                    if (PENDING_SIGNAL) return *_SINGLETON_NIL;
+                }
+                index = children.back();
+                continue;
             }
 
-            return output;
-        }
-    }
+            if (op == B_RETURN && children.size() == 1) {
+                index = children[0];
+                continue;
+            }
 
-    // ===| Base constructors |===
+            // (eval_expr (? cond (expression yes) (expression no)))
+            if (op == B_EVAL_EXPR && children.size() == 1) {
+                auto captured = evaluate_expression(&body, children[0]);
+                if (PENDING_SIGNAL) return *_SINGLETON_NIL;
+                if (captured.tag() != EXPRESSION ||
+                    captured.tree()->size() < 2) {
+                    return call_builtin(item, {&captured});
+                }
+                body = captured;
+                index = 1;
+                continue;
+            }
+        }
 
-    if (op == B_CHR) {
-        output.string = new std::string;
-        *output.string = std::string(1, args[0]->to_l());
-        output.tag = STRING;
-        return output;
-    }
+        if (item.tag() == VARIABLE) item = VARIABLE_SCOPE.get_var(item.slot());
+        if (item.tag() != CLOSURE || children.empty()) {
+            return evaluate_expression(&body, index);
+        }
 
-    if (op == B_INPUT) {
-        output.tag = STRING;
-        output.string = new std::string;
-        std::getline(std::cin, *output.string);
-        return output;
-    }
+        auto &values = call->arguments;
+        values.assign(children.size(), *_SINGLETON_NIL);
+        GCRoot item_root(&item);
+        GCRoot values_root(values.data(), values.size());
 
-    if (op == B_ORD) {
-        output.tag = NUM;
-        output.num = (*args[0]->string)[0];
-        return output;
+        for (size_t i = 0; i < children.size(); i++) {
+            values[i] = evaluate_expression(&body, children[i]);
+            if (PENDING_SIGNAL) return *_SINGLETON_NIL;
+        }
+        call->callee = item;
+        return *_SINGLETON_NIL;
     }
+}
 
-    if (op == B_INT) return {NUM, args[0]->to_l()};
-    if (op == B_FLOAT) {
-        output.tag = FLOAT;
-        output.flt = args[0]->to_f();
-        return output;
-    }
-    if (op == B_BOOL) return {BOOL, args[0]->truthiness()};
-    if (op == B_TYPE) {
-        output.type = TYPENAMES_REV.at(*args[0]->string);
-        output.tag = TYPE;
-        return output;
-    }
-    if (op == B_VECTOR) {
-        output.vector = new std::vector<LispVar>;
-        output.tag = VECTOR;
-        for (auto arg : args) { output.vector->push_back(*arg); }
-        return output;
-    }
-    if (op == B_LIST) {
-        output.list = new std::list<LispVar>;
-        output.tag = LIST;
-        for (auto arg : args) output.list->push_back(*arg);
-        return output;
-    }
-    if (op == B_CLOSURE) {
-        output = *args[0];
-        output.tag = CLOSURE;
-        return output;
-    }
+/* Collect garbage if enough has been allocated since the last collection.
+The tree walker does this when it calls a closure or goes around a loop, where
+whatever it holds on to is bound to a variable or protected by a `GCRoot`, so
+it has the same roots as the virtual machine. */
+void _safe_point() {
+    if (GC.should_collect()) VIRTUAL_MACHINE.collect_garbage();
+}
 
-    // ===| Help functions |===
-    if (op == B_HELP) {
-        output.string = new std::string;
-        *output.string = args[0]->get_help_str();
-        output.tag = STRING;
-        return output;
-    }
+/* Call a closure on the inputs.
 
-    if (op == B_COPY) return args[0]->copy();
+Calls in tail position of the body are made in the same scope instead of a
+new one, and start the region of the call again once it has grown, so a loop
+written as recursion runs in constant space. Leaving the variables of the
+caller bound doesn't change what the callee sees, since scoping is dynamic and
+it would have seen them from a scope of its own, and the caller has nothing
+left to do with them. */
+LispVar call_closure(LispVar closure, std::vector<LispVar *> arguments) {
+    assert(closure.tag() == CLOSURE);
 
-    if (op == B_LEN) return {NUM, args[0]->size()};
-    if (op == B_NOT) return {BOOL, !args[0]->truthiness()};
+    // Calling a function should first increase the scope depth.
+    VARIABLE_SCOPE.increment();
+    assert(VARIABLE_SCOPE.depth < 2048);
 
-    // Get the type of {0}.
-    if (op == B_TYPEOF) {
-        output.type = args[0]->tag;
-        output.tag = TYPE;
-        return output;
-    }
+    TailCall call = {closure, {}};
+    for (auto argument : arguments) call.arguments.push_back(*argument);
+    GCRoot callee_root(&call.callee);
 
-    // Matches the type {0} against the variables {1}.
-    if (op == B_TYPEMATCH) {
-        std::vector<LispVar *> v;
-        for (auto arg : *args[1]->vector) { v.push_back(&arg); }
-        return {BOOL, _types_match(v, *args[0])};
-    }
+    LispVar result;
+    bool tail_call = false;
+    GC.open_region();
 
-    // Assertions.
-    if (op == B_ASSERT) {
-        bool success = args[0]->truthiness();
-        _lisp_assert_or_exit(
-            success,
-            "Assertion" + ((arity == 2) ? " `" + *args[1]->string + "`" : "") +
-                " failed (evaluated " + args[0]->to_str() + ").");
+    try {
+        do {
+            auto compiled = prepare_closure(call.callee);
+            uint arity = compiled->parameters.size();
+            assert(arity == call.arguments.size());
+
+            // Then it should bind the arguments to the function values.
+            for (size_t i = 0; i < arity; i++) {
+                VARIABLE_SCOPE.set_var(compiled->parameters[i],
+                                       call.arguments[i]);
+            }
+            if (tail_call) renew_call_region(call.callee);
+            tail_call = true;
+            _safe_point();
+
+            // Then, it should evaluate the body where it is in the closure
+            // tree.
+            result = _evaluate_tail(call.callee, compiled->body_index, &call);
+        } while (call.callee.tag() == CLOSURE);
+    } catch (LispEarlyReturn &value_exception) {
+        result = value_exception.value;
+    } catch (LispBreak &exception) {
+        // Breaking out of a loop outside the closure leaves its scope too.
+        GC.merge_region();
+        VARIABLE_SCOPE.decrement();
+        throw;
+    }
+
+    if (PENDING_SIGNAL == RETURN_SIGNAL) {
+        PENDING_SIGNAL = NO_SIGNAL;
+        result = SIGNAL_VALUE;
+    } else if (PENDING_SIGNAL == BREAK_SIGNAL) {
+        GC.merge_region();
+        VARIABLE_SCOPE.decrement();
         return *_SINGLETON_NIL;
     }
 
-    // Write a string to `cout`.
-    if (op == B_PUT) {
-        for (size_t i = 0; i < arity; i++) std::cout << args[i]->to_str();
-        return *_SINGLETON_NIL;
-    }
+    _capture_locals(&result);
 
-    // Get the string representation of {0}.
-    if (op == B_REPR) {
-        output.string = new std::string;
-        output.tag = STRING;
+    // If it is a closure, it can get information from the surrounding
+    // scope. If it is a pure function, it can't. This should be checked and
+    // enforced by the Python code.
 
-        *output.string = (args[0]->tag == STRING)
-                             ? escape_string(args[0]->to_str())
-                             : args[0]->to_str();
-        return output;
-    }
+    // Finally, the scope should be exited and cleaned up.
+    VARIABLE_SCOPE.decrement();
+    GC.close_region(result);
+    return result;
+}
 
-    // Joins the contents of Q-Expressions.
-    if (op == B_JOIN) {
-        if (kind == VECTOR) {
-            output.vector = new std::vector<LispVar>;
-            output.tag = VECTOR;
-            for (auto arg : args)
-                for (auto i : *arg->vector) output.vector->push_back(i);
-            return output;
-        }
-        if (kind == STRING) {
-            output.string = new std::string;
-            output.tag = STRING;
-            for (auto arg : args) (*output.string) += (*arg->string);
-            return output;
-        }
-    }
+/* Report a call to a builtin which has no result for its arguments. */
+[[noreturn]] void _throw_could_not_evaluate(LispBuiltin op,
+                                            std::vector<LispVar *> &args) {
+    std::cout << "ExpressionEvaluationError: Could not evaluate ("
+              << BUILTINS_NAMES.at(op);
+    for (auto arg : args) std::cout << " " << arg->to_str();
+    std::cout << ")\n";
+    exit(1);
+}
 
-    // Push {1} into {0}.
-    if (op == B_PUSH) {
-        args[0]->vector->push_back(*args[1]);
-        return *_SINGLETON_NIL;
-    }
+LispVar _builtin_parse(std::vector<LispVar *> &args) {
+    return evaluate_const(*args[0]->string());
+}
 
-    // Pop the last element of {0} in place and return it.
-    if (op == B_POP) {
-        auto item = (*args[0]->vector)[args[0]->vector->size() - 1];
-        args[0]->vector->pop_back();
-        return item;
-    }
+// No operation.
+LispVar _builtin_do(std::vector<LispVar *> &args) {
+    return args.size() ? *args.back() : *_SINGLETON_NIL;
+}
 
-    // Insert {0} at index {1} in {2}.
-    if (op == B_INSERT) {
-        output.vector = new std::vector<LispVar>;
-        output.tag = VECTOR;
-
-        auto size = args[2]->size();
-        auto index = args[1]->num;
-
-        // Allows for negative indices.
-        index = (index < 0) ? size + index + 1 : index;
-        _lisp_assert_or_exit(
-            index <= size,
-            "OutOfBoundsError: Second argument of `insert` must be "
-            "less than or equal to the size of the first argument.");
-
-        for (int i = 0; i < size; i++) {
-            if (i == index) output.vector->push_back(*args[0]);
-            output.vector->push_back((*args[2])[i]);
-        }
-        if (index == size) output.vector->push_back(*args[0]);
-        return output;
-    }
+LispVar _builtin_call(std::vector<LispVar *> &args) {
+    return call_variable(*args[0], {args.begin() + 1, args.end()});
+}
 
-    if (op == B_LINSERT) {
-        output.list = new std::list<LispVar>;
-        output.tag = LIST;
+LispVar _builtin_apply(std::vector<LispVar *> &args) {
+    std::vector<LispVar> items(args[1]->vector()->begin(),
+                               args[1]->vector()->end());
+    std::vector<LispVar *> new_args;
+    for (auto &item : items) new_args.push_back(&item);
+    return call_variable(*args[0], new_args);
+}
 
-        auto size = args[2]->size();
-        auto index = args[1]->num;
+LispVar _builtin_exit(std::vector<LispVar *> &args) {
+    exit(args.size() ? args[0]->num() : 0);
+}
 
-        // Allows for negative indices.
-        index = (index < 0) ? size + index + 1 : index;
-        _lisp_assert_or_exit(
-            index <= size,
-            "OutOfBoundsError: Second argument of `insert` must be "
-            "less than or equal to the size of the first argument.");
+LispVar _builtin_while(std::vector<LispVar *> &args) {
+    while (true) {
+        auto condition = evaluate(args[0]);
+        if (PENDING_SIGNAL || !condition.truthiness()) break;
 
-        for (int i = 0; i < size; i++) {
-            if (i == index) output.list->push_back(*args[0]);
-            output.list->push_back((*args[2])[i]);
-        }
-        if (index == size) output.list->push_back(*args[0]);
-        return output;
-    }
+        try {
+            evaluate(args[1]);
+        } catch (LispBreak &_) { break; }
 
-    if (op == B_FIND) {
-        uint size = args[1]->size();
-        for (uint i = 0; i < size; i++) {
-            if (*args[0] == (*args[1])[i]) {
-                output.num = i;
-                output.tag = NUM;
-                return output;
-            }
+        // A `return` is left pending for the closure around the loop.
+        if (PENDING_SIGNAL) {
+            if (PENDING_SIGNAL == BREAK_SIGNAL) PENDING_SIGNAL = NO_SIGNAL;
+            break;
         }
-        return *_SINGLETON_NIL;
+        _safe_point();
     }
+    return *_SINGLETON_NIL;
+}
 
-    // Repeat {1} {0} times.
-    if (op == B_REPEAT) {
-        output.vector = new std::vector<LispVar>;
-        for (int i = 0; i < args[0]->num; i++)
-            output.vector->push_back(*args[1]);
-        output.tag = VECTOR;
-
-        return output;
-    }
+// Break out of a loop.
+LispVar _builtin_break(std::vector<LispVar *> &args) {
+    PENDING_SIGNAL = BREAK_SIGNAL;
+    return *_SINGLETON_NIL;
+}
 
-    // Get the {0}th element of {1}.
-    if (op == B_GET) {
-        auto size = args[1]->size();
-        auto index = args[0]->num;
-
-        // Allows for negative indices.
-        index = (index < 0) ? size + index : index;
-        _lisp_assert_or_exit(
-            index < size,
-            "OutOfBoundsError: {0} for `get` must be less than the "
-            "size of {1}.");
-        return (*args[1])[index];
-    }
-
-    // Map a function across one or more iterable, getting an iterable back.
-    if (op == B_MAP) {
-        output.vector = new std::vector<LispVar>;
-        output.tag = VECTOR;
-
-        if (arity > 1) {
-            // Checks that the sizes of the vectors are all equal.
-            auto _size = new uint;
-            *_size = args[1]->size();
-            for (size_t i = 2; i < arity; i++) {
-                _lisp_assert_or_exit(
-                    args[i]->size() == *_size,
-                    "[SizeError] The sizes of vectors used as arguments to "
-                    "`map` must all be of equal length.");
-            }
+LispVar _builtin_seed(std::vector<LispVar *> &args) {
+    RNG = std::mt19937(args[0]->num());
+    return *_SINGLETON_NIL;
+}
 
-            // Evaluate the function over the members.
-            auto _vector = new std::vector<LispVar *>;
-            for (size_t i = 0; i < *_size; i++) {
-                for (size_t j = 1; j < arity; j++) {
-                    _vector->push_back(&(*args[j]->vector)[i]);
-                }
-                (*output.vector).push_back(call_variable(*args[0], *_vector));
-                _vector->clear();
-            }
-            delete _vector;
-            delete _size;
-        }
+LispVar _builtin_return(std::vector<LispVar *> &args) {
+    PENDING_SIGNAL = RETURN_SIGNAL;
+    SIGNAL_VALUE = *args[0];
+    return *_SINGLETON_NIL;
+}
 
-        return output;
+// Generate a vector of random numbers.
+LispVar _builtin_rand(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_vector(gc_new<PersistentVector<LispVar>>());
+    for (int i = 0; i < args[0]->num(); i++) {
+        // Using the mod here fixes the casting.
+        long num = RNG() % (1 << 16);
+        output.vector()->push_back({NUM, num});
     }
+    return output;
+}
+
+// Bind a string to a variable value.
+LispVar _builtin_let(std::vector<LispVar *> &args) {
+    VARIABLE_SCOPE.set_var(_slot_of(*args[0]), *args[1]);
+    return *_SINGLETON_NIL;
+}
 
-    // Accumulate a function across an iterable, getting an iterable back.
-    if (op == B_ACCUMULATE) {
-        output.vector = new std::vector<LispVar>;
-        output.tag = VECTOR;
-        uint size = args[1]->size();
-        if (!size) return output;
+[[noreturn]] void _throw_invalid_regex(LispVar *pattern) {
+    std::cout << "RegexError: " << pattern->to_repr()
+              << " is an invalid regular expression.\n";
+    exit(1);
+}
 
-        LispVar left = (arity != 3) ? (*args[1])[0] : *args[2];
-        if (arity != 3) (*output.vector).push_back(left);
+/* Get the compiled regular expression for a REGEX or a string, or exit if it
+is invalid. */
+nfa::Regex *_compile_regex(LispVar *pattern) {
+    if (pattern->tag() == REGEX) {
+        return &REGEXES.compiled[pattern->regex_id()];
+    }
 
-        for (size_t i = (arity != 3); i < size; i++) {
-            LispVar right = ((*args[1])[i]);
-            left = call_variable(*args[0], {&left, &right});
-            (*output.vector).push_back(left);
-        }
-        return output;
+    try {
+        return REGEX_CACHE.get(*pattern->string());
+    } catch (nfa::SyntaxError const &) {
+        _throw_invalid_regex(pattern);
     }
+}
 
-    if (op == B_FOLD) {
-        LispVar accumulator;
-        uint vec_size = args[1]->vector->size();
-        uint i = 0;
+LispVar _substring(const std::string &text, size_t first, size_t last) {
+    LispVar var;
+    var.set_string(gc_new<std::string>());
+    var.string()->assign(text, first, last - first);
+    return var;
+}
 
-        if (arity == 3) {
-            accumulator = *args[2];
-        } else {
-            _lisp_assert_or_exit(vec_size,
-                                 "FoldError: An empty list cannot be folded "
-                                 "without an accumulator.\n");
-            accumulator = (*args[1]->vector)[0];
-            i = 1;
-        }
+/* Get the parts of a string which match a regular expression, or the parts
+in between them if `between` is set. As with `std::regex_token_iterator`, the
+string is kept whole if nothing matches, and an empty last part is left out. */
+LispVar _regex_tokens(std::vector<LispVar *> &args, bool between) {
+    auto &text = *args[1]->string();
+    auto spans = _compile_regex(args[0])->find_all(text);
 
-        for (; i < vec_size; i++) {
-            auto item = (*args[1]->vector)[i];
-            accumulator = call_variable(*args[0], {&accumulator, &item});
-        }
+    LispVar output;
+    output.set_vector(gc_new<PersistentVector<LispVar>>());
+    auto tokens = output.vector();
 
-        return accumulator;
+    size_t last = 0;
+    for (auto [first, end] : spans) {
+        tokens->push_back(between ? _substring(text, last, first)
+                                  : _substring(text, first, end));
+        last = end;
+    }
+    if (between && (spans.empty() || last != text.size())) {
+        tokens->push_back(_substring(text, last, text.size()));
     }
 
-    // Generates a list using a slice-like syntax.
-    if (op == B_RANGE) {
-        int start = 0;
-        int stop = -1;
-        int step = 1;
+    return output;
+}
 
-        // Allows any arity between 1 and 3.
-        if (arity == 1)
-            stop = args[0]->num;
-        else {
-            start = args[0]->num;
-            stop = args[1]->num;
-        }
-        if (arity >= 3) step = args[2]->num;
+// Return whether or not an expression matches.
+LispVar _builtin_match(std::vector<LispVar *> &args) {
+    return {BOOL, _compile_regex(args[0])->full_match(*args[1]->string())};
+}
+
+// Compile a regular expression once, to be used by other builtins.
+LispVar _builtin_regex(std::vector<LispVar *> &args) {
+    try {
+        return {REGEX, REGEXES.intern(*args[0]->string())};
+    } catch (nfa::SyntaxError const &) {
+        _throw_invalid_regex(args[0]);
+    }
+}
+
+LispVar _builtin_split(std::vector<LispVar *> &args) {
+    return _regex_tokens(args, true);
+}
 
-        output.vector = new std::vector<LispVar>;
-        output.tag = VECTOR;
+LispVar _builtin_findall(std::vector<LispVar *> &args) {
+    return _regex_tokens(args, false);
+}
 
-        if (stop > start and step < 0) return output;
-        if (stop < start and step > 0) return output;
+// ===| Base constructors |===
 
-        for (int i = start; (step > 0) ? (i < stop) : (i > stop); i += step) {
-            (*output.vector).push_back({NUM, i});
-        }
+LispVar _builtin_chr(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_string(gc_new<std::string>());
+    *output.string() = std::string(1, args[0]->to_l());
+    return output;
+}
+
+LispVar _builtin_input(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_string(gc_new<std::string>());
+    std::getline(std::cin, *output.string());
+    return output;
+}
+
+LispVar _builtin_ord(std::vector<LispVar *> &args) {
+    return {NUM, (*args[0]->string())[0]};
+}
+
+LispVar _builtin_int(std::vector<LispVar *> &args) {
+    return {NUM, args[0]->to_l()};
+}
+
+LispVar _builtin_float(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_flt(args[0]->to_f());
+    return output;
+}
+
+LispVar _builtin_bool(std::vector<LispVar *> &args) {
+    return {BOOL, args[0]->truthiness()};
+}
+
+LispVar _builtin_type(std::vector<LispVar *> &args) {
+    return {TYPE, TYPENAMES_REV.at(*args[0]->string())};
+}
+
+LispVar _builtin_vector(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_vector(gc_new<PersistentVector<LispVar>>());
+    for (auto arg : args) { output.vector()->push_back(*arg); }
+    return output;
+}
+
+LispVar _builtin_list(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_list(gc_new<std::deque<LispVar>>());
+    for (auto arg : args) output.list()->push_back(*arg);
+    return output;
+}
+
+LispVar _builtin_closure(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_tree(CLOSURE, args[0]->tree());
+    return output;
+}
+
+// Expressions are captured by the evaluator before they get here.
+LispVar _builtin_expression(std::vector<LispVar *> &args) {
+    _throw_could_not_evaluate(B_EXPRESSION, args);
+}
+
+// ===| Help functions |===
+
+LispVar _builtin_help(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_string(gc_new<std::string>());
+    *output.string() = args[0]->get_help_str();
+    return output;
+}
+
+LispVar _builtin_copy(std::vector<LispVar *> &args) { return args[0]->copy(); }
+
+LispVar _builtin_len(std::vector<LispVar *> &args) {
+    return {NUM, args[0]->size()};
+}
+
+LispVar _builtin_not(std::vector<LispVar *> &args) {
+    return {BOOL, !args[0]->truthiness()};
+}
+
+// Get the type of {0}.
+LispVar _builtin_typeof(std::vector<LispVar *> &args) {
+    return {TYPE, args[0]->tag()};
+}
+
+// Matches the type {0} against the variables {1}.
+LispVar _builtin_typematch(std::vector<LispVar *> &args) {
+    std::vector<LispVar> items(args[1]->vector()->begin(),
+                               args[1]->vector()->end());
+    std::vector<LispVar *> v;
+    for (auto &item : items) { v.push_back(&item); }
+    return {BOOL, _types_match(v, *args[0])};
+}
+
+// Assertions.
+LispVar _builtin_assert(std::vector<LispVar *> &args) {
+    bool success = args[0]->truthiness();
+    _lisp_assert_or_exit(
+        success,
+        "Assertion" +
+            ((args.size() == 2) ? " `" + *args[1]->string() + "`" : "") +
+            " failed (evaluated " + args[0]->to_str() + ").");
+    return *_SINGLETON_NIL;
+}
+
+// Write a string to `cout`.
+LispVar _builtin_put(std::vector<LispVar *> &args) {
+    for (auto arg : args) std::cout << arg->to_str();
+    return *_SINGLETON_NIL;
+}
+
+// Get the string representation of {0}.
+LispVar _builtin_repr(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_string(gc_new<std::string>());
+
+    *output.string() = (args[0]->tag() == STRING)
+                           ? escape_string(args[0]->to_str())
+                           : args[0]->to_str();
+    return output;
+}
+
+// Joins the contents of Q-Expressions.
+LispVar _builtin_join(std::vector<LispVar *> &args) {
+    LispVar output;
+
+    // Set the kind to be the type of all arguments, if they are the same.
+    LispType kind = args.size() ? args[0]->tag() : __NOT_SET__;
+    for (auto arg : args) kind = arg->tag() == kind ? kind : __NOT_SET__;
+
+    if (kind == VECTOR) {
+        // The first vector is shared rather than copied.
+        output.set_vector(gc_new<PersistentVector<LispVar>>());
+        *output.vector() = *args[0]->vector();
+        for (size_t j = 1; j < args.size(); j++)
+            for (auto i : *args[j]->vector()) output.vector()->push_back(i);
         return output;
     }
-    if (op == B_SLICE) {
-        long int start = 0;
-        long int stop = -1;
-        long int step = 1;
-        auto size = args[0]->size();
+    if (kind == STRING) {
+        output.set_string(gc_new<std::string>());
+        for (auto arg : args) (*output.string()) += (*arg->string());
+        return output;
+    }
+    _throw_could_not_evaluate(B_JOIN, args);
+}
+
+void _assert_can_pop(LispVar *container) {
+    _lisp_assert_or_exit(container->size(),
+                         "ValueError: Cannot pop from an empty " +
+                             TYPENAMES.at(container->tag()) + ".");
+}
+
+// Push {1} into {0}.
+LispVar _builtin_push(std::vector<LispVar *> &args) {
+    if (args[0]->tag() == LIST) {
+        GC.write_barrier(args[0]->list(), *args[1]);
+        args[0]->list()->push_back(*args[1]);
+    } else {
+        GC.write_barrier(args[0]->vector(), *args[1]);
+        args[0]->vector()->push_back(*args[1]);
+    }
+    return *_SINGLETON_NIL;
+}
 
-        // Allows any arity between 2 and 4.
-        if (arity >= 2) start = args[1]->num;
-        if (arity >= 3) stop = args[2]->num;
-        if (arity >= 4) step = args[3]->num;
+// Pop the last element of {0} in place and return it.
+LispVar _builtin_pop(std::vector<LispVar *> &args) {
+    _assert_can_pop(args[0]);
+    if (args[0]->tag() == LIST) {
+        auto item = args[0]->list()->back();
+        args[0]->list()->pop_back();
+        return item;
+    }
+    auto item = args[0]->vector()->back();
+    args[0]->vector()->pop_back();
+    return item;
+}
 
-        // Allows for negative indices.
-        start = (start < 0) ? size + start : start;
-        stop = (stop < 0) ? size + stop : stop;
+// Push {1} into {0} before its first element.
+LispVar _builtin_pushfront(std::vector<LispVar *> &args) {
+    if (args[0]->tag() == LIST) {
+        GC.write_barrier(args[0]->list(), *args[1]);
+        args[0]->list()->push_front(*args[1]);
+    } else {
+        GC.write_barrier(args[0]->vector(), *args[1]);
+        args[0]->vector()->push_front(*args[1]);
+    }
+    return *_SINGLETON_NIL;
+}
 
-        // Cut off too large indices.
-        stop = std::min(stop, size - 1);
-        start = std::min(start, size - 1);
+// Pop the first element of {0} in place and return it.
+LispVar _builtin_popfront(std::vector<LispVar *> &args) {
+    _assert_can_pop(args[0]);
+    if (args[0]->tag() == LIST) {
+        auto item = args[0]->list()->front();
+        args[0]->list()->pop_front();
+        return item;
+    }
+    auto item = args[0]->vector()->front();
+    args[0]->vector()->pop_front();
+    return item;
+}
 
-        if (args[0]->tag == VECTOR) {
-            output.tag = VECTOR;
-            output.vector = new std::vector<LispVar>;
+/* Get the index {0} is inserted at by `insert` and `linsert`. */
+long _insert_index(std::vector<LispVar *> &args) {
+    auto size = args[2]->size();
+    auto index = args[1]->num();
+
+    // Allows for negative indices.
+    index = (index < 0) ? size + index + 1 : index;
+    _lisp_assert_or_exit(
+        index <= size,
+        "OutOfBoundsError: Second argument of `insert` must be "
+        "less than or equal to the size of the first argument.");
+    return index;
+}
 
-            if (stop > start && step < 0) return output;
-            if (stop < start && step > 0) return output;
+// Insert {0} at index {1} in {2}.
+LispVar _builtin_insert(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_vector(gc_new<PersistentVector<LispVar>>());
 
-            for (int i = start; (step > 0) ? (i <= stop) : (i >= stop);
-                 i += step) {
-                (*output.vector).push_back((*args[0]->vector)[i]);
-            }
+    auto size = args[2]->size();
+    auto index = _insert_index(args);
 
-            return output;
-        }
+    // Appending to a vector shares its items instead of copying them.
+    if (index == size && args[2]->tag() == VECTOR) {
+        *output.vector() = *args[2]->vector();
+        output.vector()->push_back(*args[0]);
+        return output;
+    }
 
-        if (args[0]->tag == STRING) {
-            output.tag = STRING;
-            output.string = new std::string;
+    for (int i = 0; i < size; i++) {
+        if (i == index) output.vector()->push_back(*args[0]);
+        output.vector()->push_back((*args[2])[i]);
+    }
+    if (index == size) output.vector()->push_back(*args[0]);
+    return output;
+}
 
-            std::ostringstream buf;
+// Replace the item at index {1} in {2} with {0}.
+LispVar _builtin_update(std::vector<LispVar *> &args) {
+    auto size = args[2]->size();
+    auto index = args[1]->num();
 
-            if (stop > start && step < 0) return output;
-            if (stop < start && step > 0) return output;
+    // Allows for negative indices.
+    index = (index < 0) ? size + index : index;
+    _lisp_assert_or_exit(
+        0 <= index && index < size,
+        "OutOfBoundsError: Second argument of `update` must be an "
+        "index of the third argument.");
 
-            for (int i = start; (step > 0) ? (i <= stop) : (i >= stop);
-                 i += step) {
-                buf << (*args[0]->string)[i];
-            }
+    LispVar output;
+    output.set_vector(gc_new<PersistentVector<LispVar>>());
+    *output.vector() = *args[2]->vector();
+    output.vector()->set(index, *args[0]);
+    return output;
+}
 
-            *output.string = buf.str();
-            return output;
-        }
+LispVar _builtin_linsert(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_list(gc_new<std::deque<LispVar>>());
 
-        std::cout << "Slice not implemented for this type\n";
-        exit(1);
+    auto size = args[2]->size();
+    auto index = _insert_index(args);
+
+    for (int i = 0; i < size; i++) {
+        if (i == index) output.list()->push_back(*args[0]);
+        output.list()->push_back((*args[2])[i]);
+    }
+    if (index == size) output.list()->push_back(*args[0]);
+    return output;
+}
+
+LispVar _builtin_find(std::vector<LispVar *> &args) {
+    uint size = args[1]->size();
+    for (uint i = 0; i < size; i++) {
+        if (*args[0] == (*args[1])[i]) {
+            return {NUM, i};
+        }
     }
+    return *_SINGLETON_NIL;
+}
 
-    if (op == B_EVAL_EXPR) { return evaluate_expression(args[0], 1); }
+// Repeat {1} {0} times.
+LispVar _builtin_repeat(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_vector(gc_new<PersistentVector<LispVar>>());
+    for (int i = 0; i < args[0]->num(); i++)
+        output.vector()->push_back(*args[1]);
 
-    // Flow control
-    if (op == B_TERNARY) { return args[0]->truthiness() ? *args[1] : *args[2]; }
+    return output;
+}
 
-    // Numeric functions
-    if (op == B_ADD) {
-        bool can_be_int = true;
-        for (auto arg : args) {
-            can_be_int &= arg->tag != FLOAT;
-            if (!can_be_int) break;
+// Get the {0}th element of {1}.
+LispVar _builtin_get(std::vector<LispVar *> &args) {
+    auto size = args[1]->size();
+    auto index = args[0]->num();
+
+    // Allows for negative indices.
+    index = (index < 0) ? size + index : index;
+    _lisp_assert_or_exit(
+        index < size,
+        "OutOfBoundsError: {0} for `get` must be less than the "
+        "size of {1}.");
+    return (*args[1])[index];
+}
+
+// Map a function across one or more iterable, getting an iterable back.
+LispVar _builtin_map(std::vector<LispVar *> &args) {
+    LispVar output;
+    auto arity = args.size();
+    output.set_vector(gc_new<PersistentVector<LispVar>>());
+    GCRoot output_root(&output);
+
+    if (arity > 1) {
+        // Checks that the sizes of the vectors are all equal.
+        auto _size = new uint;
+        *_size = args[1]->size();
+        for (size_t i = 2; i < arity; i++) {
+            _lisp_assert_or_exit(
+                args[i]->size() == *_size,
+                "[SizeError] The sizes of vectors used as arguments to "
+                "`map` must all be of equal length.");
         }
-        if (can_be_int) {
-            output.tag = NUM;
-            output.num = accumulate_l(&args, 0, std::plus<long>());
-            return output;
-        } else {
-            output.tag = FLOAT;
-            output.flt = accumulate_f(&args, 0, std::plus<float>());
-            return output;
+
+        // Evaluate the function over the members.
+        auto _vector = new std::vector<LispVar *>;
+        std::vector<LispVar> row(arity - 1);
+        for (size_t i = 0; i < *_size; i++) {
+            for (size_t j = 1; j < arity; j++) {
+                row[j - 1] = (*args[j]->vector())[i];
+                _vector->push_back(&row[j - 1]);
+            }
+            (*output.vector()).push_back(call_variable(*args[0], *_vector));
+            _vector->clear();
         }
+        delete _vector;
+        delete _size;
     }
-    if (op == B_MUL) {
-        bool can_be_int = true;
-        for (auto arg : args) {
-            can_be_int &= arg->tag != FLOAT;
-            if (!can_be_int) break;
+
+    return output;
+}
+
+// Accumulate a function across an iterable, getting an iterable back.
+LispVar _builtin_accumulate(std::vector<LispVar *> &args) {
+    LispVar output;
+    auto arity = args.size();
+    output.set_vector(gc_new<PersistentVector<LispVar>>());
+    uint size = args[1]->size();
+    if (!size) return output;
+
+    LispVar left = (arity != 3) ? (*args[1])[0] : *args[2];
+    if (arity != 3) (*output.vector()).push_back(left);
+    GCRoot output_root(&output);
+
+    for (size_t i = (arity != 3); i < size; i++) {
+        LispVar right = ((*args[1])[i]);
+        GCRoot right_root(&right);
+        left = call_variable(*args[0], {&left, &right});
+        (*output.vector()).push_back(left);
+    }
+    return output;
+}
+
+LispVar _builtin_fold(std::vector<LispVar *> &args) {
+    LispVar accumulator;
+    uint vec_size = args[1]->vector()->size();
+    uint i = 0;
+
+    if (args.size() == 3) {
+        accumulator = *args[2];
+    } else {
+        _lisp_assert_or_exit(vec_size,
+                             "FoldError: An empty list cannot be folded "
+                             "without an accumulator.\n");
+        accumulator = (*args[1]->vector())[0];
+        i = 1;
+    }
+
+    GCRoot accumulator_root(&accumulator);
+
+    for (; i < vec_size; i++) {
+        auto item = (*args[1]->vector())[i];
+        GCRoot item_root(&item);
+        accumulator = call_variable(*args[0], {&accumulator, &item});
+    }
+
+    return accumulator;
+}
+
+// Keep the items of an iterable for which a function returns a truthy value.
+LispVar _builtin_filter(std::vector<LispVar *> &args) {
+    LispVar output;
+    output.set_vector(gc_new<PersistentVector<LispVar>>());
+    GCRoot output_root(&output);
+
+    uint size = args[1]->size();
+    for (uint i = 0; i < size; i++) {
+        auto item = (*args[1])[i];
+        GCRoot item_root(&item);
+        if (call_variable(*args[0], {&item}).truthiness()) {
+            output.vector()->push_back(item);
         }
-        if (can_be_int) {
-            output.tag = NUM;
-            output.num = accumulate_l(&args, 1, std::multiplies<long>());
-            return output;
-        } else {
-            output.tag = FLOAT;
-            output.flt = accumulate_f(&args, 1, std::multiplies<float>());
+    }
+    return output;
+}
+
+// Generates a list using a slice-like syntax.
+LispVar _builtin_range(std::vector<LispVar *> &args) {
+    LispVar output;
+    auto arity = args.size();
+    int start = 0;
+    int stop = -1;
+    int step = 1;
+
+    // Allows any arity between 1 and 3.
+    if (arity == 1)
+        stop = args[0]->num();
+    else {
+        start = args[0]->num();
+        stop = args[1]->num();
+    }
+    if (arity >= 3) step = args[2]->num();
+
+    output.set_vector(gc_new<PersistentVector<LispVar>>());
+
+    if (stop > start and step < 0) return output;
+    if (stop < start and step > 0) return output;
+
+    for (int i = start; (step > 0) ? (i < stop) : (i > stop); i += step) {
+        (*output.vector()).push_back({NUM, i});
+    }
+    return output;
+}
+
+/* Get the first and last index `slice` takes and the step between them,
+returning false if it takes nothing. */
+bool _slice_bounds(std::vector<LispVar *> &args,
+                   long &start,
+                   long &stop,
+                   long &step) {
+    auto arity = args.size();
+    start = 0;
+    stop = -1;
+    step = 1;
+    auto size = args[0]->size();
+
+    // Allows any arity between 2 and 4.
+    if (arity >= 2) start = args[1]->num();
+    if (arity >= 3) stop = args[2]->num();
+    if (arity >= 4) step = args[3]->num();
+
+    // Allows for negative indices.
+    start = (start < 0) ? size + start : start;
+    stop = (stop < 0) ? size + stop : stop;
+
+    // Cut off too large indices.
+    stop = std::min(stop, size - 1);
+    start = std::min(start, size - 1);
+
+    if (!size) return false;
+    if (stop > start && step < 0) return false;
+    if (stop < start && step > 0) return false;
+    return true;
+}
+
+LispVar _builtin_slice(std::vector<LispVar *> &args) {
+    LispVar output;
+    long start, stop, step;
+    bool any = _slice_bounds(args, start, stop, step);
+
+    if (args[0]->tag() == VECTOR) {
+        output.set_vector(gc_new<PersistentVector<LispVar>>());
+        if (!any) return output;
+
+        // Contiguous slices share their items with the vector.
+        if (step == 1) {
+            *output.vector() =
+                args[0]->vector()->slice(std::max(start, 0L), stop + 1);
             return output;
         }
-    }
-    if (op == B_AND) {
-        output.tag = NUM;
-        output.num = accumulate_l(&args, ~0, std::bit_and<long>());
+
+        for (int i = start; (step > 0) ? (i <= stop) : (i >= stop);
+             i += step) {
+            (*output.vector()).push_back((*args[0]->vector())[i]);
+        }
+
         return output;
     }
-    if (op == B_OR) {
-        output.tag = NUM;
-        output.num = accumulate_l(&args, 0, std::bit_or<long>());
+
+    if (args[0]->tag() == STRING) {
+        output.set_string(gc_new<std::string>());
+        if (!any) return output;
+
+        std::ostringstream buf;
+
+        for (int i = start; (step > 0) ? (i <= stop) : (i >= stop);
+             i += step) {
+            buf << (*args[0]->string())[i];
+        }
+
+        *output.string() = buf.str();
         return output;
     }
-    if (op == B_XOR) {
-        output.tag = NUM;
-        output.num = accumulate_l(&args, 0, std::bit_xor<long>());
+
+    std::cout << "Slice not implemented for this type\n";
+    exit(1);
+}
+
+LispVar _builtin_eval_expr(std::vector<LispVar *> &args) {
+    return evaluate(args[0], 1);
+}
+
+// Flow control
+LispVar _builtin_ternary(std::vector<LispVar *> &args) {
+    return args[0]->truthiness() ? *args[1] : *args[2];
+}
+
+/* Whether or not none of the arguments are floats. */
+bool _can_be_int(std::vector<LispVar *> &args) {
+    for (auto arg : args) {
+        if (arg->tag() == FLOAT) return false;
+    }
+    return true;
+}
+
+// Numeric functions
+LispVar _builtin_add(std::vector<LispVar *> &args) {
+    LispVar output;
+    if (_can_be_int(args)) {
+        output.set_num(accumulate_l(&args, 0, std::plus<long>()));
+    } else {
+        output.set_flt(accumulate_f(&args, 0, std::plus<float>()));
+    }
+    return output;
+}
+
+LispVar _builtin_mul(std::vector<LispVar *> &args) {
+    LispVar output;
+    if (_can_be_int(args)) {
+        output.set_num(accumulate_l(&args, 1, std::multiplies<long>()));
+    } else {
+        output.set_flt(accumulate_f(&args, 1, std::multiplies<float>()));
+    }
+    return output;
+}
+
+LispVar _builtin_and(std::vector<LispVar *> &args) {
+    return {NUM, accumulate_l(&args, ~0, std::bit_and<long>())};
+}
+
+LispVar _builtin_or(std::vector<LispVar *> &args) {
+    return {NUM, accumulate_l(&args, 0, std::bit_or<long>())};
+}
+
+LispVar _builtin_xor(std::vector<LispVar *> &args) {
+    return {NUM, accumulate_l(&args, 0, std::bit_xor<long>())};
+}
+
+LispVar _builtin_eq(std::vector<LispVar *> &args) {
+    // All arguments should be equal.
+    bool equal = true;
+    if (args.empty()) return {BOOL, equal};
+    auto first = *args[0];
+    for (size_t i = 1; i < args.size(); i++) {
+        equal = first == *args[i];
+        if (!equal) break;
+    }
+    return {BOOL, equal};
+}
+
+LispVar _builtin_neq(std::vector<LispVar *> &args) {
+    // All arguments should be different.
+    bool different = true;
+    if (args.empty()) return {BOOL, different};
+    auto first = *args[0];
+    for (size_t i = 1; i < args.size(); i++) {
+        different = first != *args[i];
+        if (!different) break;
+    }
+    return {BOOL, different};
+}
+
+LispVar _builtin_gt(std::vector<LispVar *> &args) {
+    // All arguments should be strictly decreasing.
+    return {BOOL, vector_is_ordered(&args, std::greater<float>())};
+}
+
+LispVar _builtin_lt(std::vector<LispVar *> &args) {
+    // All arguments should be strictly increasing.
+    return {BOOL, vector_is_ordered(&args, std::less<float>())};
+}
+
+LispVar _builtin_geq(std::vector<LispVar *> &args) {
+    // All arguments should be non-strictly decreasing.
+    return {BOOL, vector_is_ordered(&args, std::greater_equal<float>())};
+}
+
+LispVar _builtin_leq(std::vector<LispVar *> &args) {
+    // All arguments should be non-strictly increasing.
+    return {BOOL, vector_is_ordered(&args, std::less_equal<float>())};
+}
+
+// 2-ary numeric functions
+LispVar _builtin_sub(std::vector<LispVar *> &args) {
+    LispVar output;
+    if (_can_be_int(args)) return {NUM, args[0]->num() - args[1]->num()};
+    output.set_flt(PNUMPART(args[0]) - PNUMPART(args[1]));
+    return output;
+}
+
+LispVar _builtin_div(std::vector<LispVar *> &args) {
+    LispVar output;
+    if (_can_be_int(args)) return {NUM, args[0]->num() / args[1]->num()};
+    output.set_flt(PNUMPART(args[0]) / PNUMPART(args[1]));
+    return output;
+}
+
+LispVar _builtin_mod(std::vector<LispVar *> &args) {
+    return {NUM, args[0]->num() % args[1]->num()};
+}
+
+// 1-ary numeric functions
+LispVar _builtin_neg(std::vector<LispVar *> &args) {
+    LispVar output;
+    if (args[0]->tag() == FLOAT) {
+        output.set_flt(-args[0]->flt());
         return output;
     }
-    if (op == B_EQ) {
-        // All arguments should be equal.
-        output.num = true;
-        output.tag = BOOL;
-        if (!arity) return output;
-        auto first = *args[0];
-        for (size_t i = 1; i < arity; i++) {
-            output.num = first == *args[i];
-            if (!output.num) break;
-        }
+    return {args[0]->tag(), -args[0]->num()};
+}
+
+LispVar _builtin_flip(std::vector<LispVar *> &args) {
+    return {NUM, ~args[0]->num()};
+}
+
+LispVar _builtin_sgn(std::vector<LispVar *> &args) {
+    auto value = args[0]->to_f();
+    return {NUM, (value > 0) - (value < 0)};
+}
+
+LispVar _builtin_abs(std::vector<LispVar *> &args) {
+    LispVar output;
+    if (args[0]->tag() == FLOAT) {
+        output.set_flt(std::fabs(args[0]->flt()));
         return output;
     }
-    if (op == B_NEQ) {
-        // All arguments should be different.
-        output.num = true;
-        output.tag = BOOL;
-        if (!arity) return output;
-        auto first = *args[0];
-        for (size_t i = 1; i < arity; i++) {
-            output.num = first != *args[i];
-            if (!output.num) break;
+    output.set_num(std::labs(args[0]->to_l()));
+    return output;
+}
+
+// Raise {0} to the power of {1} by repeated squaring.
+LispVar _builtin_pow(std::vector<LispVar *> &args) {
+    LispVar output;
+    auto exponent = args[1]->num();
+    if (exponent <= 0) return {NUM, 1};
+
+    if (args[0]->tag() == FLOAT) {
+        double base = args[0]->flt();
+        double result = 1;
+        for (; exponent; exponent >>= 1, base *= base) {
+            if (exponent & 1) result *= base;
         }
+        output.set_flt(result);
         return output;
     }
-    if (op == B_GT) {
-        // All arguments should be strictly decreasing.
-        output.tag = BOOL;
-        output.num = vector_is_ordered(&args, std::greater<float>());
-        return output;
+
+    // Unsigned, so that overflow wraps around the same way as `mul`.
+    uint64_t base = args[0]->to_l();
+    uint64_t result = 1;
+    for (; exponent; exponent >>= 1, base *= base) {
+        if (exponent & 1) result *= base;
     }
-    if (op == B_LT) {
-        // All arguments should be strictly increasing.
-        output.tag = BOOL;
-        output.num = vector_is_ordered(&args, std::less<float>());
-        return output;
+    output.set_num(result);
+    return output;
+}
+
+LispVar _builtin_factorial(std::vector<LispVar *> &args) {
+    LispVar output;
+    auto n = args[0]->num();
+    uint64_t result = 1;
+    // Past 65, the product has wrapped around to zero for good.
+    for (long i = 2; i <= n && result; i++) result *= i;
+    output.set_num(result);
+    return output;
+}
+
+/* Exit unless a vector holds nothing but numbers. */
+void _check_numeric_items(LispVar *vector) {
+    for (auto item : *vector->vector()) {
+        if (!item.is_numeric()) _throw_could_not_cast({TYPE, NUMERIC}, item);
     }
-    if (op == B_GEQ) {
-        // All arguments should be non-strictly decreasing.
-        output.tag = BOOL;
-        output.num = vector_is_ordered(&args, std::greater_equal<float>());
-        return output;
+}
+
+/* Find the item of a vector which `better` prefers to all the items after it,
+or the last one if there is no such item. */
+LispVar _best_item(LispVar *vector,
+                   std::function<bool(float, float)> better,
+                   std::string name) {
+    _check_numeric_items(vector);
+    auto &items = *vector->vector();
+    _lisp_assert_or_exit(!items.empty(),
+                         "ValueError: An empty vector has no " + name + ".");
+
+    auto best = items[0];
+    for (size_t i = 1; i < items.size(); i++) {
+        if (!better(best.to_f(), items[i].to_f())) best = items[i];
+    }
+    return best;
+}
+
+LispVar _builtin_max(std::vector<LispVar *> &args) {
+    return _best_item(args[0], std::greater<float>(), "largest item");
+}
+
+LispVar _builtin_min(std::vector<LispVar *> &args) {
+    return _best_item(args[0], std::less<float>(), "smallest item");
+}
+
+LispVar _builtin_avg(std::vector<LispVar *> &args) {
+    _check_numeric_items(args[0]);
+    std::vector<LispVar> numbers(args[0]->vector()->begin(),
+                                 args[0]->vector()->end());
+    std::vector<LispVar *> items;
+    for (auto &number : numbers) items.push_back(&number);
+
+    LispVar output;
+    auto sum = _builtin_add(items);
+    output.set_flt(sum.to_f() / items.size());
+    return output;
+}
+
+// Least number of items each thread sorts.
+const size_t PARALLEL_SORT_SLICE = 1 << 15;
+
+/* Sort a vector on several threads when it is long enough to be worth it.
+
+Each thread sorts a slice, and the slices are then merged pairwise. Merging is
+stable, so the result is stable whenever the slices are sorted stably. */
+template <typename T, typename Less>
+void _parallel_sort(std::vector<T> &items, Less less, bool stable) {
+    auto sort_slice = [&items, less, stable](size_t start, size_t stop) {
+        if (stable) {
+            std::stable_sort(items.begin() + start, items.begin() + stop, less);
+        } else {
+            std::sort(items.begin() + start, items.begin() + stop, less);
+        }
+    };
+
+    size_t slices = std::min<size_t>(std::thread::hardware_concurrency(),
+                                     items.size() / PARALLEL_SORT_SLICE);
+    if (slices < 2) return sort_slice(0, items.size());
+
+    std::vector<size_t> bounds;
+    for (size_t i = 0; i <= slices; i++) {
+        bounds.push_back(items.size() * i / slices);
     }
-    if (op == B_LEQ) {
-        // All arguments should be non-strictly increasing.
-        output.tag = BOOL;
-        output.num = vector_is_ordered(&args, std::less_equal<float>());
-        return output;
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < slices; i++) {
+        threads.emplace_back(sort_slice, bounds[i], bounds[i + 1]);
     }
+    sort_slice(bounds[0], bounds[1]);
+    for (auto &thread : threads) thread.join();
 
-    // 2-ary numeric functions
-    if (op == B_SUB) {
-        bool can_be_int = true;
-        for (auto arg : args) {
-            can_be_int &= arg->tag != FLOAT;
-            if (!can_be_int) break;
+    for (size_t width = 1; width < slices; width *= 2) {
+        for (size_t i = 0; i + width < slices; i += 2 * width) {
+            auto stop = bounds[std::min(i + 2 * width, slices)];
+            std::inplace_merge(items.begin() + bounds[i],
+                               items.begin() + bounds[i + width],
+                               items.begin() + stop, less);
         }
-        if (can_be_int) {
-            return {NUM, args[0]->num - args[1]->num};
-        } else {
-            output.tag = FLOAT;
-            output.flt = PNUMPART(args[0]) - PNUMPART(args[1]);
-            return output;
+    }
+}
+
+/* Reorder the items of a vector by the position each key is sorted to. */
+template <typename K, typename Less>
+LispVar _sort_by_keys(LispVar *vector, std::vector<std::pair<K, uint>> &keyed,
+                      Less less, bool stable) {
+    _parallel_sort(
+        keyed,
+        [less](const std::pair<K, uint> &a, const std::pair<K, uint> &b) {
+            return less(a.first, b.first);
+        },
+        stable);
+
+    LispVar output;
+    output.set_vector(gc_new<PersistentVector<LispVar>>());
+    auto &items = *vector->vector();
+    for (auto &key : keyed) output.vector()->push_back(items[key.second]);
+    return output;
+}
+
+/* Sort a vector by a vector of keys, one for each of its items.
+
+The keys are unboxed before sorting, so they have to be all strings or all
+numbers. Numbers are compared as integers unless one of them is a float. */
+LispVar _sort_items(LispVar *vector, LispVar *keys, bool stable) {
+    auto &items = *keys->vector();
+    uint size = items.size();
+
+    if (size && items[0].tag() == STRING) {
+        std::vector<std::pair<std::string *, uint>> keyed;
+        keyed.reserve(size);
+        for (uint i = 0; i < size; i++) {
+            if (items[i].tag() != STRING)
+                _throw_could_not_cast({TYPE, STRING}, items[i]);
+            keyed.push_back({items[i].string(), i});
         }
+        return _sort_by_keys(
+            vector, keyed,
+            [](std::string *a, std::string *b) { return *a < *b; }, stable);
+    }
+
+    _check_numeric_items(keys);
+    bool has_floats =
+        std::any_of(items.begin(), items.end(),
+                    [](LispVar key) { return key.tag() == FLOAT; });
+
+    if (has_floats) {
+        std::vector<std::pair<float, uint>> keyed;
+        keyed.reserve(size);
+        for (uint i = 0; i < size; i++) keyed.push_back({items[i].to_f(), i});
+        return _sort_by_keys(vector, keyed, std::less<float>(), stable);
+    }
+
+    std::vector<std::pair<long, uint>> keyed;
+    keyed.reserve(size);
+    for (uint i = 0; i < size; i++) keyed.push_back({items[i].num(), i});
+    return _sort_by_keys(vector, keyed, std::less<long>(), stable);
+}
+
+/* Call a function on every item of a vector, computing each key only once. */
+LispVar _sort_keys(LispVar *function, LispVar *vector) {
+    LispVar keys;
+    keys.set_vector(gc_new<PersistentVector<LispVar>>());
+    GCRoot keys_root(&keys);
+
+    uint size = vector->size();
+    for (uint i = 0; i < size; i++) {
+        auto item = (*vector)[i];
+        GCRoot item_root(&item);
+        keys.vector()->push_back(call_variable(*function, {&item}));
     }
-    if (op == B_DIV) {
-        bool can_be_int = true;
+    return keys;
+}
+
+LispVar _builtin_sort(std::vector<LispVar *> &args) {
+    return _sort_items(args[0], args[0], false);
+}
+
+LispVar _builtin_sort_by(std::vector<LispVar *> &args) {
+    auto keys = _sort_keys(args[0], args[1]);
+    GCRoot keys_root(&keys);
+    return _sort_items(args[1], &keys, false);
+}
+
+LispVar _builtin_stable_sort_by(std::vector<LispVar *> &args) {
+    auto keys = _sort_keys(args[0], args[1]);
+    GCRoot keys_root(&keys);
+    return _sort_items(args[1], &keys, true);
+}
+
+/* Change the value `insert`, `join` or `slice` is given into its result,
+returning false if that can't be done in place. */
+bool _update_in_place(LispBuiltin op,
+                      std::vector<LispVar *> &args,
+                      LispVar value) {
+    auto target = _updated_argument(op);
+    if (args[target]->heap_pointer() != value.heap_pointer()) return false;
+
+    if (op == B_JOIN) {
         for (auto arg : args) {
-            can_be_int &= arg->tag != FLOAT;
-            if (!can_be_int) break;
+            if (arg->tag() != value.tag()) return false;
         }
-        if (can_be_int) {
-            return {NUM, args[0]->num / args[1]->num};
-        } else {
-            output.tag = FLOAT;
-            output.flt = PNUMPART(args[0]) / PNUMPART(args[1]);
-            return output;
+        if (value.tag() == STRING) {
+            for (size_t i = 1; i < args.size(); i++) {
+                value.string()->append(*args[i]->string());
+            }
+            return true;
+        }
+        for (size_t i = 1; i < args.size(); i++) {
+            for (auto item : *args[i]->vector()) {
+                GC.write_barrier(value.vector(), item);
+                value.vector()->push_back(item);
+            }
         }
+        return true;
     }
-    if (op == B_MOD) {
-        output.tag = NUM;
-        output.num = args[0]->num % args[1]->num;
-        return output;
+
+    if (op == B_INSERT) {
+        if (value.tag() != VECTOR) return false;
+        if (_insert_index(args) != args[2]->size()) return false;
+        GC.write_barrier(value.vector(), *args[0]);
+        value.vector()->push_back(*args[0]);
+        return true;
     }
 
-    // 1-ary numeric functions
-    if (op == B_NEG) {
-        output.tag = args[0]->tag;
-        if (output.tag == NUM)
-            output.num = -args[0]->num;
-        else
-            output.flt = -args[0]->flt;
-        return output;
+    // Only contiguous slices are taken in place.
+    long start, stop, step;
+    bool any = _slice_bounds(args, start, stop, step);
+    if (step != 1 && any) return false;
+    start = std::max(start, 0L);
+    stop = any ? stop + 1 : start;
+
+    if (value.tag() == VECTOR) {
+        *value.vector() = value.vector()->slice(start, stop);
+        return true;
     }
+    if (value.tag() == STRING) {
+        *value.string() = value.string()->substr(start, stop - start);
+        return true;
+    }
+    return false;
+}
 
-    if (op == B_FLIP) return {NUM, ~args[0]->num};
+/* Exit if the arguments don't match the signature of a builtin. */
+void _check_builtin_args(LispVar operation, std::vector<LispVar *> &args) {
+    auto op = operation.builtin();
+    if (BUILTINS_TYPES_READY && SAFE_MODE && !operation.is_proven()) {
+        auto signature = BUILTINS_SIGNATURES[op];
+        if (!signature) {
+            std::cout << "[bug] Operation '" << op
+                      << "' is not typed. Exiting.\n";
+            exit(1);
+        }
+        if (!signature->matches(args)) {
+            LispVar actual_type;
+            actual_type.set_vector(gc_new<PersistentVector<LispVar>>());
+            for (auto arg : args) { actual_type.vector()->push_back(*arg); }
 
-    // Results haven't been set.
-    std::cout << "ExpressionEvaluationError: Could not evaluate ("
-              << BUILTINS_NAMES.at(op);
-    for (size_t i = 0; i < arity; i++) std::cout << " " << args[i]->to_str();
-    std::cout << ")\n";
+            _throw_could_not_cast(*BUILTINS_TYPES[op], actual_type, operation);
+        }
+    }
+}
+
+/* Perform an operation on the inputs. */
+LispVar call_builtin(LispVar operation, std::vector<LispVar *> args) {
+    assert(operation.tag() == BUILTIN);
+
+    if (args.size() == 1 && *args[0] == *_SINGLETON_NOARGS_TOKEN) args = {};
+    _check_builtin_args(operation, args);
+    return BUILTIN_FUNCTIONS[operation.builtin()](args);
+}
+
+/* Perform `insert`, `join` or `slice` on the value of a variable which is
+about to be rebound to the result.
+
+If the variable holds the only reference to its value, the value is changed in
+place and returned, so that nothing has to be copied. */
+LispVar update_builtin(LispVar operation,
+                       std::vector<LispVar *> args,
+                       unsigned int slot) {
+    assert(operation.tag() == BUILTIN);
+
+    _check_builtin_args(operation, args);
+    auto op = operation.builtin();
+    if (VARIABLE_SCOPE.is_taken(slot)) {
+        auto value = VARIABLE_SCOPE.peek_var(slot);
+        if (_update_in_place(op, args, value)) return value;
+    }
+    return BUILTIN_FUNCTIONS[op](args);
+}
+
+/* Report an integer literal which doesn't fit in a number. */
+[[noreturn]] void _throw_number_too_large(const std::string &item) {
+    std::cout << "[ParseError] The integer `" << item
+              << "` is too large to be a number.";
     exit(1);
 }
 
+/* Parse a token as a number the way `std::stoi` and `std::stold` would,
+returning whether or not it is one. Unlike them, this doesn't throw if it
+isn't, since most tokens are names. Integers too large for a `long` are an
+error rather than names. */
+bool _parse_number(const std::string &item, LispVar *output) {
+    auto first = item.data();
+    auto last = first + item.size();
+    while (first != last && isspace((unsigned char)*first)) first++;
+
+    // `std::from_chars` only allows a minus sign.
+    if (last - first >= 2 && first[0] == '+' && first[1] != '-') first++;
+
+    if (item.find('.') != std::string::npos) {
+        long double value;
+        if (std::from_chars(first, last, value).ec != std::errc()) {
+            return false;
+        }
+        output->set_flt(value);
+        return true;
+    }
+
+    long value;
+    auto error = std::from_chars(first, last, value).ec;
+    if (error == std::errc::result_out_of_range) _throw_number_too_large(item);
+    if (error != std::errc()) return false;
+    *output = {NUM, value};
+    return true;
+}
+
 /* Evaluate a constant. */
-LispVar evaluate_const(std::string item) {
+LispVar evaluate_const(const std::string &item) {
     LispVar output;
-    bool is_function = LISP_BUILTINS.count(item);
 
-    if (is_function) {
-        output.builtin = BUILTINS_NUMS.at(item);
-        output.tag = BUILTIN;
+    // Strings and numbers aren't interned, since there's no end to them.
+    if (item.size() >= 2 && item[0] == '"' && item[item.size() - 1] == '"') {
+        output.set_string(new std::string);
+        *output.string() = unescape_string(item);
         return output;
     }
 
-    if (!item.compare("expression")) {
-        output.string = new std::string;
-        *output.string = item;
-        output.tag = BUILTIN;
-        return output;
+    if (_parse_number(item, &output)) return output;
+
+    auto symbol = SYMBOLS.intern(item);
+    if (symbol < BUILTINS_NAMES.size()) return {BUILTIN, symbol};
+
+    // Calls marked by the preprocessor as always being well typed.
+    if (item.size() >= 2 && item[0] == '$') {
+        auto builtin = SYMBOLS.intern(std::string_view(item).substr(1));
+        if (builtin < BUILTINS_NAMES.size()) {
+            return {BUILTIN, builtin | BUILTIN_PROVEN};
+        }
     }
 
     if (!item.compare("Yes")) { return {BOOL, 1}; }
     if (!item.compare("No")) { return {BOOL, 0}; }
     if (!item.compare("Nil")) { return *_SINGLETON_NIL; }
 
-    if (item.size() >= 2 && item[0] == '"' && item[item.size() - 1] == '"') {
-        output.string = new std::string;
-        *output.string = unescape_string(item);
-        output.tag = STRING;
-        return output;
-    }
-
-    try {
-        if (item.find('.') != std::string::npos) {
-            // Floats
-            output.tag = FLOAT;
-            output.flt = std::stold(item);
-            return output;
-        } else {
-            // Integers
-            return {NUM, std::stoi(item)};
-        }
-    } catch (const std::invalid_argument &e) {
-        output.string = new std::string;
-        *output.string = item;
-        output.tag = VARIABLE;
-        return output;
-    }
+    // Variables are resolved to their slots once, while parsing.
+    return {VARIABLE, VARIABLE_SCOPE.resolve(symbol)};
 }
 
 /* Evaluates a tree.
@@ -1210,51 +1952,53 @@ Note that the variable resolution takes place when they are called as leaf nodes
 in this context.
 */
 LispVar evaluate_expression(LispVar *expression, uint index) {
-    auto item = expression->tree->nodes[index];
+    FUEL.burn();
+    auto item = expression->tree()->nodes[index];
 
     // Resolves variables.
-    if (item.tag == VARIABLE) { item = VARIABLE_SCOPE.get_var(item.string); }
-    bool is_function = item.tag == BUILTIN || item.tag == CLOSURE;
+    if (item.tag() == VARIABLE) { item = VARIABLE_SCOPE.get_var(item.slot()); }
+    bool is_function = item.tag() == BUILTIN || item.tag() == CLOSURE;
 
     if (!is_function) return item;
 
     // Capture expressions literally.
-    if (item.builtin == B_EXPRESSION) {
-        LispVar result;
-        Tree<LispVar> *subtree = new Tree<LispVar>;
-        *subtree = expression->tree->subtree(index);
-
-        result.tag = EXPRESSION;
-        result.tree = subtree;
-        return result;
+    if (item.builtin() == B_EXPRESSION) {
+        return capture_expression(expression->tree(), index);
     }
 
     // Allow binding to variables.
     // This is very scuffed right now and obviously WIP.
-    if (item.builtin == B_LET) {
+    if (item.builtin() == B_LET) {
         LispVar result = evaluate_expression(expression, index + 2);
-        VARIABLE_SCOPE.set_var(expression->tree->nodes[index + 1].string,
+        if (PENDING_SIGNAL) return result;
+        VARIABLE_SCOPE.set_var(_slot_of(expression->tree()->nodes[index + 1]),
                                result);
 
         return result;
     }
 
+    // The values are kept alive while the other arguments are evaluated and
+    // the function is called.
+    auto children = expression->tree()->children(index);
+    std::vector<LispVar> values(children.size(), *_SINGLETON_NIL);
     std::vector<LispVar *> arguments;
-    auto size = expression->tree->nodes.size();
-    auto original_depth = expression->tree->depths[index];
-
-    for (size_t i = index + 1;
-         (original_depth != expression->tree->depths[i]) & (i < size);
-         i++) {
-        if ((original_depth + 1) == expression->tree->depths[i]) {
-            auto inner = new LispVar;
-            *inner = evaluate_expression(expression, i);
-            arguments.push_back(inner);
-        }
+    GCRoot item_root(&item);
+    GCRoot values_root(values.data(), values.size());
+
+    // A `break` or `return` skips whatever is left to evaluate.
+    for (size_t i = 0; i < children.size(); i++) {
+        values[i] = evaluate_expression(expression, children[i]);
+        if (PENDING_SIGNAL) return *_SINGLETON_NIL;
+        arguments.push_back(&values[i]);
     }
-    auto result = arguments.empty() ? item : call_variable(item, arguments);
-    arguments.clear();
-    return result;
+    return arguments.empty() ? item : _call_variable(item, arguments);
+}
+
+/* Evaluate a node of an expression using the engine picked on the command
+line. */
+LispVar evaluate(LispVar *expression, uint index) {
+    if (VM_MODE) return VIRTUAL_MACHINE.evaluate(expression, index);
+    return evaluate_expression(expression, index);
 }
 
 LispVar parse_and_evaluate(std::string input) {
@@ -1262,14 +2006,34 @@ LispVar parse_and_evaluate(std::string input) {
     return evaluate_expression(&tree, 0);
 }
 
+void _print_gc_stats() { GC.print_stats(); }
+void _print_regex_stats() { REGEX_CACHE.print_stats(); }
+
+/* Read a limit given on the command line, which has to be a number no less
+than 0. */
+template <class T>
+T _read_limit(const char *argument, const char *name) {
+    T value;
+    auto last = argument + std::strlen(argument);
+    auto result = std::from_chars(argument, last, value);
+    if (result.ec != std::errc() || result.ptr != last || !(value >= 0)) {
+        std::cout << "Error: The " << name
+                  << " must be a non-negative number, not `" << argument
+                  << "`.\n";
+        exit(1);
+    }
+    return value;
+}
+
 void print_debug(std::string msg) {
     if (DEBUG_MODE) { std::cout << "[DEBUG] " << msg; }
 }
 
 int main(int argc, char const *argv[]) {
-    if (argc < 4) {
-        std::cout << "Error: Expected at least 3 command-line arguments "
-                     "(filename, debug mode, and safe mode)."
+    if (argc < 9) {
+        std::cout << "Error: Expected at least 8 command-line arguments "
+                     "(filename, debug mode, safe mode, engine, GC "
+                     "statistics, step limit, timeout and GC threshold)."
                   << '\n';
         exit(1);
     }
@@ -1278,35 +2042,38 @@ int main(int argc, char const *argv[]) {
 
     DEBUG_MODE = std::stoi(argv[2]);
     SAFE_MODE = std::stoi(argv[3]);
+    VM_MODE = std::stoi(argv[4]);
+    if (std::stoi(argv[5])) std::atexit(_print_gc_stats);
+    FUEL.set_max_steps(_read_limit<uint64_t>(argv[6], "step limit"));
+    FUEL.set_timeout(_read_limit<double>(argv[7], "timeout"));
+    auto threshold = _read_limit<uint64_t>(argv[8], "GC threshold");
+    if (threshold) GC.set_min_threshold(threshold);
+    if (DEBUG_MODE) std::atexit(_print_regex_stats);
     RNG = std::mt19937(since_epoch.count());
 
     // Set argv to the command-line arguments.
     LispVar argv_lisp_var;
 
-    argv_lisp_var.vector = new std::vector<LispVar>;
-    argv_lisp_var.tag = VECTOR;
+    argv_lisp_var.set_vector(new PersistentVector<LispVar>);
 
     // Add the filename.
     LispVar filename;
 
-    filename.string = new std::string;
-    *filename.string = argv[0];
-    filename.tag = STRING;
+    filename.set_string(new std::string);
+    *filename.string() = argv[0];
 
-    argv_lisp_var.vector->push_back(filename);
+    argv_lisp_var.vector()->push_back(filename);
 
-    for (int i = 4; i < argc; i++) {
+    for (int i = 9; i < argc; i++) {
         LispVar argument;
 
-        argument.string = new std::string;
-        *argument.string = argv[i];
-        argument.tag = STRING;
+        argument.set_string(new std::string);
+        *argument.string() = argv[i];
 
-        argv_lisp_var.vector->push_back(argument);
+        argv_lisp_var.vector()->push_back(argument);
     }
 
-    std::string varname = "argv";
-    VARIABLE_SCOPE.set_var(&varname, argv_lisp_var);
+    VARIABLE_SCOPE.set_var(VARIABLE_SCOPE.resolve("argv"), argv_lisp_var);
 
     _fill_out_lisp_builtin_types();
 
@@ -1316,11 +2083,26 @@ int main(int argc, char const *argv[]) {
     auto expr = buffer.str();
 
     auto tree = parse_expression(expr);
-    print_debug("Dumping AST below:\n");
-    print_debug(tree.to_str() + ":\n");
-    print_debug("Done\n");
+    // Expressions captured from the program are found through it.
+    GCRoot tree_root(&tree);
+
+    // The dumps are only made when they are printed, since making them takes
+    // longer than parsing.
+    if (DEBUG_MODE) {
+        print_debug("Dumping AST below:\n");
+        print_debug(tree.to_str() + ":\n");
+        print_debug("Done\n");
+    }
+
+    if (VM_MODE && DEBUG_MODE) {
+        print_debug("Dumping bytecode below:\n");
+        print_debug(compile_chunk(tree.tree(), 0)->to_str() + "\n");
+        print_debug("Done\n");
+    }
+
     print_debug("Evaluating AST at node 0.\n");
-    evaluate_expression(&tree, 0);
+    evaluate(&tree, 0);
+    raise_signal();
 
     std::cout << '\n';
     return 0;
@@ -6,8 +6,10 @@ The singletons are the following:
 - _SINGLETON_NOARGS_TOKEN
 */
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <iostream>
-#include <list>
 #include <map>
 #include <sstream>
 #include <string>
@@ -15,10 +17,11 @@ The singletons are the following:
 
 #include "escape.h"
 #include "gen_builtins.h"
+#include "persistent_vector.h"
 #include "tree.h"
 
-#define NUMPART(a) (a.tag == FLOAT ? a.flt : a.num)
-#define PNUMPART(a) (a->tag == FLOAT ? a->flt : a->num)
+#define NUMPART(a) (a.tag() == FLOAT ? a.flt() : a.num())
+#define PNUMPART(a) (a->tag() == FLOAT ? a->flt() : a->num())
 
 enum LispType {
     NUM,
@@ -33,6 +36,7 @@ enum LispType {
     EXPRESSION,
     VARIABLE,
     CLOSURE,
+    REGEX,
     ANY,
     BOOLY,
     FALSY,
@@ -41,6 +45,7 @@ enum LispType {
     CALLABLE,
     ITERABLE,
     INDEXABLE,
+    PATTERN,
     STAR,
     QMARK,
     PLUS,
@@ -51,30 +56,136 @@ enum LispType {
 [[noreturn]] void _throw_does_not_implement(LispType type,
                                             std::string notimplemented);
 
-/* A Lisp runtime variable. */
+/* Allocate a payload on the garbage collected heap (see `gc.h`). */
+template <class T>
+T *gc_new();
+
+/* How the rest of a LispVar is used, kept in its lowest three bits.
+
+Payloads are at least 8-byte aligned, so pointers to them can be stored with
+the tag in the bits which are always zero. */
+enum LispVarBits : uint64_t {
+    BITS_NUM = 0,         // An integer in the upper 61 bits.
+    BITS_STRING = 1,      // Pointers to payloads.
+    BITS_VECTOR = 2,
+    BITS_LIST = 3,
+    BITS_EXPRESSION = 4,
+    BITS_CLOSURE = 5,
+    BITS_IMMEDIATE = 6,   // A LispType in bits 3-7, and 32 bits of payload.
+    BITS_BOXED_NUM = 7,   // A pointer to an integer which does not fit.
+};
+
+const uint64_t BITS_MASK = 7;
+
+// Set in the payload of builtins called with arguments which the preprocessor
+// has proven to have the right types, so that they aren't checked again.
+const uint32_t BUILTIN_PROVEN = 1 << 16;
+
+/* A Lisp runtime variable.
+
+Every value is a single tagged 64-bit word. Numbers, floats, booleans and the
+other small values are stored in the word itself, while strings, vectors,
+lists and trees are pointers to payloads on the heap. */
 class LispVar {
    public:
-    LispType tag;
-    union {
-        long int num;                  // Used by NUM, NIL, BOOL.
-        float flt;                     // Used by FLOAT.
-        std::string *string;           // Used by STRING and VARIABLE.
-        std::vector<LispVar> *vector;  // Used by VECTOR.
-        std::list<LispVar> *list;      // Used by LIST.
-        Tree<LispVar> *tree;           // Used by EXPRESSION.
-        LispBuiltin builtin;           // Used by BUILTIN.
-        LispType type;                 // Used by TYPE.
-    };
+    uint64_t bits;
 
-    LispVar operator[](unsigned int index) {
-        if (tag == VECTOR) return (*vector)[index];
-        if (tag == LIST) {
-            auto first = list->begin();
-            std::advance(first, index);
-            return *first;
+    LispVar() : bits(_immediate(NIL, 0)) {}
+
+    /* Make a value which is not stored on the heap, such as {NUM, 1}. */
+    LispVar(LispType tag, long value) {
+        if (tag == NUM)
+            set_num(value);
+        else if (tag == FLOAT)
+            set_flt(value);
+        else
+            bits = _immediate(tag, value);
+    }
+
+    LispType tag() const {
+        static constexpr LispType tags[] = {
+            NUM, STRING, VECTOR, LIST, EXPRESSION, CLOSURE, NIL, NUM};
+        auto low = bits & BITS_MASK;
+        if (low == BITS_IMMEDIATE) return (LispType)((bits >> 3) & 31);
+        return tags[low];
+    }
+
+    // Used by NUM, NIL and BOOL.
+    long num() const {
+        auto low = bits & BITS_MASK;
+        if (low == BITS_NUM) return (int64_t)bits >> 3;
+        if (low == BITS_BOXED_NUM) return *(long *)(bits & ~BITS_MASK);
+        return (int32_t)(bits >> 32);
+    }
+
+    float flt() const {
+        float value;
+        uint32_t payload = bits >> 32;
+        std::memcpy(&value, &payload, sizeof(value));
+        return value;
+    }
+
+    std::string *string() const { return (std::string *)_pointer(); }
+    PersistentVector<LispVar> *vector() const {
+        return (PersistentVector<LispVar> *)_pointer();
+    }
+    std::deque<LispVar> *list() const {
+        return (std::deque<LispVar> *)_pointer();
+    }
+    // Used by EXPRESSION and CLOSURE.
+    Tree<LispVar> *tree() const { return (Tree<LispVar> *)_pointer(); }
+    LispBuiltin builtin() const {
+        return (LispBuiltin)((bits >> 32) & (BUILTIN_PROVEN - 1));
+    }
+    bool is_proven() const { return (bits >> 32) & BUILTIN_PROVEN; }
+    LispType type() const { return (LispType)(bits >> 32); }  // Used by TYPE.
+    unsigned int slot() const { return bits >> 32; }  // Used by VARIABLE.
+    unsigned int regex_id() const { return bits >> 32; }  // Used by REGEX.
+
+    void set_num(long value) {
+        // Integers which lose their top bits when shifted are boxed.
+        if (((int64_t)((uint64_t)value << 3) >> 3) == value) {
+            bits = (uint64_t)value << 3;
+            return;
         }
+        auto box = gc_new<long>();
+        *box = value;
+        bits = (uint64_t)box | BITS_BOXED_NUM;
+    }
 
-        _throw_does_not_implement(tag, "index");
+    void set_flt(float value) {
+        uint32_t payload;
+        std::memcpy(&payload, &value, sizeof(value));
+        bits = ((uint64_t)payload << 32) | ((uint64_t)FLOAT << 3) |
+               BITS_IMMEDIATE;
+    }
+
+    void set_string(std::string *string) {
+        bits = (uint64_t)string | BITS_STRING;
+    }
+    void set_vector(PersistentVector<LispVar> *vector) {
+        bits = (uint64_t)vector | BITS_VECTOR;
+    }
+    void set_list(std::deque<LispVar> *list) {
+        bits = (uint64_t)list | BITS_LIST;
+    }
+    void set_tree(LispType tag, Tree<LispVar> *tree) {
+        bits = (uint64_t)tree |
+               (tag == CLOSURE ? BITS_CLOSURE : BITS_EXPRESSION);
+    }
+
+    /* The payload on the heap, if there is one. */
+    void *heap_pointer() const {
+        auto low = bits & BITS_MASK;
+        if (low == BITS_NUM || low == BITS_IMMEDIATE) return nullptr;
+        return _pointer();
+    }
+
+    LispVar operator[](unsigned int index) {
+        if (tag() == VECTOR) return (*vector())[index];
+        if (tag() == LIST) return (*list())[index];
+
+        _throw_does_not_implement(tag(), "index");
     }
 
     /* Whether or not one variable equals another. */
@@ -86,95 +197,99 @@ class LispVar {
         // Zeroes can still be created in other ways (- 1 1)
         // but the bug messes up everything for no good reason.
 
-        // if (is_whole_numeric()) { return num == var.num; }
+        // if (is_whole_numeric()) { return num() == var.num(); }
 
-        if (var.tag != tag) return false;
+        if (var.tag() != tag()) return false;
         // If it's a singleton, tags being the same imply that the objects are
         // the same.
         if (is_singleton()) return true;
-        if (tag == BUILTIN) { return builtin == var.builtin; }
+        if (tag() == BUILTIN) { return builtin() == var.builtin(); }
         if (is_numeric()) { return PNUMPART(this) == NUMPART(var); }
-        if (tag == STRING) return !(*string).compare(*var.string);
+        if (tag() == STRING) return !(*string()).compare(*var.string());
+        if (tag() == VARIABLE) return slot() == var.slot();
+        if (tag() == REGEX) return regex_id() == var.regex_id();
 
         // Compare the contents.
-        if (tag == VECTOR) {
+        if (tag() == VECTOR || tag() == LIST) {
             unsigned int var_size = var.size();
             if (var_size != size()) return false;
             for (size_t i = 0; i < var_size; i++) {
-                if ((*vector)[i] != (*var.vector)[i]) return false;
+                if ((*this)[i] != var[i]) return false;
             }
             return true;
         }
 
-        if (tag == EXPRESSION) return (*tree) == var.tree;
+        if (tag() == EXPRESSION) return (*tree()) == var.tree();
 
-        std::cout << tag << '\n';
+        std::cout << tag() << '\n';
         std::cout << "Reached forbidden part of the == operator for LispVar.\n";
         exit(1);
     }
 
     bool operator!=(LispVar var) { return !(*this == var); }
 
-    constexpr bool is_singleton() {
-        return (tag == __NOT_SET__ || tag == __NO_ARGS__ || tag == NIL);
+    bool is_singleton() {
+        return (tag() == __NOT_SET__ || tag() == __NO_ARGS__ || tag() == NIL);
     }
 
-    bool is_whole_numeric() { return (tag == NUM || tag == BOOL); }
+    bool is_whole_numeric() { return (tag() == NUM || tag() == BOOL); }
 
-    bool is_numeric() { return (tag == NUM || tag == BOOL || tag == FLOAT); }
+    bool is_numeric() {
+        return (tag() == NUM || tag() == BOOL || tag() == FLOAT);
+    }
 
-    bool is_callable() { return (tag == BUILTIN || tag == CLOSURE); }
+    bool is_callable() { return (tag() == BUILTIN || tag() == CLOSURE); }
 
     bool is_sized() {
-        return (tag == STRING || tag == VECTOR || tag == LIST ||
-                tag == EXPRESSION || tag == CLOSURE);
+        return (tag() == STRING || tag() == VECTOR || tag() == LIST ||
+                tag() == EXPRESSION || tag() == CLOSURE);
     }
 
     bool is_booly() {
-        return (tag == NUM || tag == NIL || tag == BOOL || is_sized());
+        return (tag() == NUM || tag() == NIL || tag() == BOOL || is_sized());
     }
 
     bool truthiness() {
-        if (tag == NUM || tag == NIL || tag == BOOL || tag == FLOAT) return num;
+        // The payload of a float is zero exactly when its bits are.
+        if (tag() == NUM || tag() == NIL || tag() == BOOL || tag() == FLOAT)
+            return num();
         if (is_sized()) return size();
-        _throw_does_not_implement(tag, "truthiness");
+        _throw_does_not_implement(tag(), "truthiness");
     }
 
     long size() {
-        if (tag == STRING) return string->size();
-        if (tag == VECTOR) return vector->size();
-        if (tag == LIST) return list->size();
-        if (tag == EXPRESSION || tag == CLOSURE) return tree->size();
-        _throw_does_not_implement(tag, "size");
+        if (tag() == STRING) return string()->size();
+        if (tag() == VECTOR) return vector()->size();
+        if (tag() == LIST) return list()->size();
+        if (tag() == EXPRESSION || tag() == CLOSURE) return tree()->size();
+        _throw_does_not_implement(tag(), "size");
     }
 
     LispVar copy() {
-        LispVar output;
-        output.tag = tag;
-        if (tag == NUM || tag == NIL || tag == BOOL)
-            output.num = num;
-        else if (tag == FLOAT)
-            output.flt = flt;
-        else if (tag == BUILTIN)
-            output.builtin = builtin;
-        else if (tag == STRING || tag == TYPE || tag == VARIABLE) {
-            auto str = new std::string;
-            *str = *string;
-            output.string = str;
-        } else if (tag == VECTOR) {
-            auto vec = new std::vector<LispVar>;
-            *vec = *vector;
-            output.vector = vec;
-        } else if (tag == LIST) {
-            auto ls = new std::list<LispVar>;
-            *ls = *list;
-            output.list = ls;
-        } else if (tag == EXPRESSION) {
-            auto new_tree = new Tree<LispVar>;
-            *new_tree = *tree;
-            output.tree = new_tree;
+        LispVar output = *this;
+        auto current = tag();
+
+        if (current == STRING) {
+            auto str = gc_new<std::string>();
+            *str = *string();
+            output.set_string(str);
+        } else if (current == VECTOR) {
+            auto vec = gc_new<PersistentVector<LispVar>>();
+            *vec = *vector();
+            output.set_vector(vec);
+        } else if (current == LIST) {
+            auto ls = gc_new<std::deque<LispVar>>();
+            *ls = *list();
+            output.set_list(ls);
+        } else if (current == EXPRESSION) {
+            auto new_tree = gc_new<Tree<LispVar>>();
+            *new_tree = *tree();
+            output.set_tree(EXPRESSION, new_tree);
         } else
-            assert(false);
+            assert(current == NUM || current == NIL || current == BOOL ||
+                   current == FLOAT || current == BUILTIN ||
+                   current == TYPE || current == VARIABLE ||
+                   current == REGEX);
 
         return output;
     }
@@ -193,52 +308,94 @@ class LispVar {
 
     std::string to_repr() {
         auto str = to_str();
-        if (tag == STRING) { return escape_string(str); }
+        if (tag() == STRING) { return escape_string(str); }
         return str;
     }
 
     std::string _pretty_tree() {
         std::stringstream ss;
-        auto size = tree->size();
+        auto size = tree()->size();
         for (size_t i = 0; i < size; i++) {
-            if (tree->depths[i]) ss << "│ ";
-            for (size_t j = 1; j < tree->depths[i]; j++) ss << "· ";
-            ss << tree->nodes[i].to_str();
+            if (tree()->depths[i]) ss << "│ ";
+            for (size_t j = 1; j < tree()->depths[i]; j++) ss << "· ";
+            ss << tree()->nodes[i].to_str();
             if (i != size - 1) { ss << "\n"; }
         }
         return ss.str();
     }
 
     bool contents_have_same_tag() {
-        if (tag != LIST) {
+        if (tag() != LIST) {
             std::cout << "ERROR" << '\n';
             exit(1);
         }
-        unsigned int size = vector->size();
+        unsigned int size = vector()->size();
         for (size_t i = 1; i < size; i++) {
-            if ((*vector)[i].tag != (*vector)[i - 1].tag) return 0;
+            if ((*vector())[i].tag() != (*vector())[i - 1].tag()) return 0;
         }
         return 1;
     }
 
     bool contents_are_unsized() {
-        if (tag != LIST) {
+        if (tag() != LIST) {
             std::cout << "ERROR" << '\n';
             exit(1);
         }
-        unsigned int size = vector->size();
+        unsigned int size = vector()->size();
         for (size_t i = 0; i < size; i++) {
-            if ((*vector)[i].is_sized()) return 0;
+            if ((*vector())[i].is_sized()) return 0;
         }
         return 1;
     }
 
     std::string to_str();
     std::string get_help_str();
+
+   private:
+    static constexpr uint64_t _immediate(LispType tag, long value) {
+        return ((uint64_t)(uint32_t)value << 32) | ((uint64_t)tag << 3) |
+               BITS_IMMEDIATE;
+    }
+
+    void *_pointer() const { return (void *)(bits & ~BITS_MASK); }
 };
 
+static_assert(sizeof(LispVar) == 8, "LispVar should fit in a single word.");
+
 LispVar parse_and_evaluate(std::string input);
 
+struct LispEarlyReturn : public std::exception {
+    LispVar value;
+    const char *what() const throw() {
+        return "Uncaught LispEarlyReturn exception";
+    }
+};
+
+struct LispBreak : public std::exception {
+    const char *what() const throw() { return "Uncaught LispBreak exception"; }
+};
+
+/* A `break` or `return` on its way out of the tree walker, which passes it up
+to the loop or closure it leaves by returning early instead of throwing. */
+enum LispSignal { NO_SIGNAL, BREAK_SIGNAL, RETURN_SIGNAL };
+
+LispSignal PENDING_SIGNAL = NO_SIGNAL;
+LispVar SIGNAL_VALUE;  // The value of a pending `return`.
+
+/* Throw the pending signal as an exception, for callers which don't check for
+signals themselves. */
+void raise_signal() {
+    auto signal = PENDING_SIGNAL;
+    PENDING_SIGNAL = NO_SIGNAL;
+
+    if (signal == BREAK_SIGNAL) throw LispBreak();
+    if (signal == RETURN_SIGNAL) {
+        LispEarlyReturn early_return;
+        early_return.value = SIGNAL_VALUE;
+        throw early_return;
+    }
+}
+
 auto _SINGLETON_NIL = new LispVar;
 auto _SINGLETON_NOT_SET = new LispVar;
 auto _SINGLETON_NOARGS_TOKEN = new LispVar;
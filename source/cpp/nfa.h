@@ -0,0 +1,1044 @@
+/* A regular expression engine which runs in linear time.
+
+Patterns are compiled into a program for a Thompson NFA, which is run as a
+Pike VM: every way of matching is followed at once, one character at a time,
+so no input can make it backtrack. The ways are kept in the order a
+backtracking engine would try them, which gives the same matches as the
+ECMAScript grammar of `std::regex`.
+
+Most searches don't need the VM. A DFA built lazily from the program finds
+where the first match ends, and another built from the reversed program walks
+back from there to where it starts. Searches which ignore empty matches, and
+patterns whose DFAs grow too large, fall back to the VM.
+
+Supported syntax
+================
+- Characters, `.` and escapes such as \d \w \s \D \W \S \n \t \xHH and \.
+- Classes such as [a-z_], [^\d] and [[:alpha:]].
+- The quantifiers * + ? {n} {n,} {n,m}, which are lazy if followed by ?.
+- Groups (...) and (?:...), and alternatives separated by |.
+- The assertions ^ $ \b and \B.
+
+Back-references and lookaheads can't be matched in linear time, so patterns
+using them are rejected. Where a repeated group can match nothing, such as in
+(a|)*, an empty repetition may be preferred over a longer one. */
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace nfa {
+
+/* Thrown for patterns which are invalid or use unsupported syntax. */
+struct SyntaxError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+using CharSet = std::bitset<256>;
+using Span = std::pair<size_t, size_t>;  // Where a match starts and ends.
+
+const unsigned int UNBOUNDED = UINT_MAX;
+const size_t MAX_PROGRAM_SIZE = 1 << 16;
+
+enum Op : uint8_t {
+    CHAR,    // Consume the character `arg`.
+    SET,     // Consume a character in the set `arg`.
+    ASSERT,  // Go on if the assertion `arg` holds here.
+    SPLIT,   // Go on at `x`, and at `y` with a lower priority.
+    JUMP,    // Go on at `x`.
+    MATCH,   // Finish a match.
+};
+
+enum Assertion : uint8_t {
+    AT_START,
+    AT_END,
+    WORD_BOUNDARY,
+    NOT_WORD_BOUNDARY,
+};
+
+struct Inst {
+    Op op;
+    uint32_t arg = 0;
+    uint32_t x = 0;
+    uint32_t y = 0;
+};
+
+/* A parsed piece of a pattern. */
+struct Node {
+    enum Kind { CHAR, SET, ASSERT, CONCAT, ALTERNATE, REPEAT } kind;
+    uint32_t arg = 0;  // The character, set or assertion.
+    std::vector<Node> children;
+
+    // Used by REPEAT.
+    unsigned int min = 0;
+    unsigned int max = 0;
+    bool greedy = true;
+};
+
+CharSet _char_range(unsigned char first, unsigned char last) {
+    CharSet set;
+    for (unsigned int c = first; c <= last; c++) set.set(c);
+    return set;
+}
+
+CharSet _chars(const char *chars) {
+    CharSet set;
+    for (; *chars; chars++) set.set((unsigned char)*chars);
+    return set;
+}
+
+const CharSet DIGITS = _char_range('0', '9');
+const CharSet WORD_CHARS =
+    DIGITS | _char_range('a', 'z') | _char_range('A', 'Z') | _chars("_");
+const CharSet SPACES = _chars(" \t\n\v\f\r");
+const CharSet LINE_TERMINATORS = _chars("\n\r");
+
+/* Turns a pattern into nodes, adding the character sets it uses to `sets`. */
+class Parser {
+   public:
+    Parser(const std::string &pattern, std::vector<CharSet> &sets)
+        : pattern(pattern), sets(sets) {}
+
+    Node parse() {
+        auto node = _alternation();
+        if (pos != pattern.size()) _fail("unmatched ')'");
+        return node;
+    }
+
+   private:
+    const std::string &pattern;
+    std::vector<CharSet> &sets;
+    size_t pos = 0;
+
+    [[noreturn]] void _fail(std::string message) {
+        throw SyntaxError(message + " at position " + std::to_string(pos));
+    }
+
+    bool _at_end() { return pos == pattern.size(); }
+    unsigned char _peek() { return pattern[pos]; }
+
+    bool _eat(char c) {
+        if (_at_end() || _peek() != c) return false;
+        pos++;
+        return true;
+    }
+
+    Node _set(CharSet set) {
+        sets.push_back(set);
+        return {Node::SET, (uint32_t)sets.size() - 1, {}, 0, 0, true};
+    }
+
+    Node _alternation() {
+        std::vector<Node> options = {_concatenation()};
+        while (_eat('|')) options.push_back(_concatenation());
+        if (options.size() == 1) return options[0];
+        return {Node::ALTERNATE, 0, options, 0, 0, true};
+    }
+
+    Node _concatenation() {
+        Node node = {Node::CONCAT, 0, {}, 0, 0, true};
+        while (!_at_end() && _peek() != '|' && _peek() != ')') {
+            node.children.push_back(_quantified());
+        }
+        return node;
+    }
+
+    Node _quantified() {
+        auto atom = _atom();
+        if (_at_end()) return atom;
+
+        unsigned int min = 0, max = 1;
+        if (_eat('*')) {
+            max = UNBOUNDED;
+        } else if (_eat('+')) {
+            min = 1, max = UNBOUNDED;
+        } else if (_peek() == '{') {
+            _braces(min, max);
+        } else if (!_eat('?')) {
+            return atom;
+        }
+
+        if (atom.kind == Node::ASSERT) _fail("nothing to repeat");
+        Node node = {Node::REPEAT, 0, {atom}, min, max, true};
+        node.greedy = !_eat('?');
+        return node;
+    }
+
+    /* Read a quantifier like {2,5}, leaving the position at its end. */
+    void _braces(unsigned int &min, unsigned int &max) {
+        pos++;
+        min = max = _number();
+        if (_eat(',')) {
+            max = (!_at_end() && _peek() == '}') ? UNBOUNDED : _number();
+        }
+        if (_at_end() || _peek() != '}') _fail("invalid repetition");
+        if (min > max) _fail("invalid repetition range");
+        pos++;
+    }
+
+    unsigned int _number() {
+        if (_at_end() || !isdigit(_peek())) _fail("expected a number");
+        unsigned long number = 0;
+        while (!_at_end() && isdigit(_peek())) {
+            number = number * 10 + (pattern[pos++] - '0');
+            if (number > 1000) _fail("repetition count is too large");
+        }
+        return number;
+    }
+
+    Node _atom() {
+        unsigned char c = pattern[pos++];
+        switch (c) {
+            case '(': {
+                if (_eat('?') && !_eat(':')) _fail("unsupported group");
+                auto node = _alternation();
+                if (!_eat(')')) _fail("unmatched '('");
+                return node;
+            }
+            case '[':
+                return _set(_class());
+            case '.':
+                return _set(~LINE_TERMINATORS);
+            case '^':
+                return {Node::ASSERT, AT_START, {}, 0, 0, true};
+            case '$':
+                return {Node::ASSERT, AT_END, {}, 0, 0, true};
+            case '\\':
+                return _escape();
+            case '*':
+            case '+':
+            case '?':
+            case '{':
+                pos--;
+                _fail("nothing to repeat");
+            default:
+                return {Node::CHAR, c, {}, 0, 0, true};
+        }
+    }
+
+    Node _escape() {
+        if (_at_end()) _fail("trailing backslash");
+        auto c = _peek();
+        if (c == 'b' || c == 'B') {
+            pos++;
+            auto assertion = c == 'b' ? WORD_BOUNDARY : NOT_WORD_BOUNDARY;
+            return {Node::ASSERT, assertion, {}, 0, 0, true};
+        }
+
+        CharSet set;
+        if (_class_escape(set)) return _set(set);
+        return {Node::CHAR, _char_escape(), {}, 0, 0, true};
+    }
+
+    /* Read an escape like \d which stands for a set of characters. */
+    bool _class_escape(CharSet &set) {
+        switch (_peek()) {
+            case 'd': set = DIGITS; break;
+            case 'D': set = ~DIGITS; break;
+            case 'w': set = WORD_CHARS; break;
+            case 'W': set = ~WORD_CHARS; break;
+            case 's': set = SPACES; break;
+            case 'S': set = ~SPACES; break;
+            default: return false;
+        }
+        pos++;
+        return true;
+    }
+
+    /* Read an escape which stands for a single character. */
+    unsigned char _char_escape() {
+        unsigned char c = pattern[pos++];
+        switch (c) {
+            case 'f': return '\f';
+            case 'n': return '\n';
+            case 'r': return '\r';
+            case 't': return '\t';
+            case 'v': return '\v';
+            case '0':
+                if (!_at_end() && isdigit(_peek())) _fail("invalid escape");
+                return '\0';
+            case 'c':
+                if (_at_end() || !isalpha(_peek())) _fail("invalid escape");
+                return pattern[pos++] % 32;
+            case 'x':
+                return _hex(2);
+            case 'u': {
+                auto code = _hex(4);
+                if (code > 0xFF) _fail("character is too large");
+                return code;
+            }
+        }
+        if (isdigit(c)) _fail("back-references are not supported");
+        if (isalnum(c)) _fail("invalid escape");
+        return c;
+    }
+
+    unsigned int _hex(int digits) {
+        unsigned int value = 0;
+        for (int i = 0; i < digits; i++) {
+            if (_at_end() || !isxdigit(_peek())) _fail("invalid escape");
+            unsigned char c = pattern[pos++];
+            value = value * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+        }
+        return value;
+    }
+
+    /* Read a class like [^a-z] after its opening bracket. */
+    CharSet _class() {
+        CharSet set;
+        bool negated = _eat('^');
+
+        while (true) {
+            if (_at_end()) _fail("unmatched '['");
+            if (_eat(']')) break;
+
+            CharSet item;
+            int first = _class_atom(item);
+            if (first < 0 || _at_end() || _peek() != '-' ||
+                pos + 1 >= pattern.size() || pattern[pos + 1] == ']') {
+                set |= item;
+                continue;
+            }
+
+            pos++;
+            int last = _class_atom(item);
+            if (last < 0 || first > last) _fail("invalid range");
+            set |= _char_range(first, last);
+        }
+
+        return negated ? ~set : set;
+    }
+
+    /* Read one character of a class into `set`, returning it, or -1 if it
+    was an escape like \d or a name like [:alpha:]. */
+    int _class_atom(CharSet &set) {
+        set.reset();
+
+        if (_eat('\\')) {
+            if (_at_end()) _fail("trailing backslash");
+            if (_class_escape(set)) return -1;
+            int c = _eat('b') ? '\b' : _char_escape();
+            set.set(c);
+            return c;
+        }
+
+        if (pattern.compare(pos, 2, "[:") == 0) {
+            auto end = pattern.find(":]", pos + 2);
+            if (end == std::string::npos) _fail("unmatched '[:'");
+            set = _named_class(pattern.substr(pos + 2, end - pos - 2));
+            pos = end + 2;
+            return -1;
+        }
+        if (pattern.compare(pos, 2, "[.") == 0 ||
+            pattern.compare(pos, 2, "[=") == 0) {
+            _fail("collating elements are not supported");
+        }
+
+        unsigned char c = pattern[pos++];
+        set.set(c);
+        return c;
+    }
+
+    CharSet _named_class(std::string name) {
+        int (*test)(int) = nullptr;
+        if (name == "alnum") test = isalnum;
+        if (name == "alpha") test = isalpha;
+        if (name == "blank") test = isblank;
+        if (name == "cntrl") test = iscntrl;
+        if (name == "digit" || name == "d") test = isdigit;
+        if (name == "graph") test = isgraph;
+        if (name == "lower") test = islower;
+        if (name == "print") test = isprint;
+        if (name == "punct") test = ispunct;
+        if (name == "space" || name == "s") test = isspace;
+        if (name == "upper") test = isupper;
+        if (name == "xdigit") test = isxdigit;
+        if (name == "w") return WORD_CHARS;
+        if (!test) _fail("unknown class name '" + name + "'");
+
+        CharSet set;
+        for (int c = 0; c < 128; c++) {
+            if (test(c)) set.set(c);
+        }
+        return set;
+    }
+};
+
+/* How a search is done, like the flags of `std::regex_search`. */
+struct SearchOptions {
+    bool prev_avail = false;  // Whether the text before the start counts.
+    bool not_null = false;    // Whether empty matches are ignored.
+    bool continuous = false;  // Whether matches must begin at the start.
+};
+
+/* What the assertions can tell about a place in the text. */
+enum Context : uint8_t {
+    AFTER_NOTHING = 1,     // Nothing comes before, as far as ^ can tell.
+    BEFORE_NOTHING = 2,    // Nothing comes after.
+    AFTER_WORD_CHAR = 4,   // A word character comes before.
+    BEFORE_WORD_CHAR = 8,  // A word character comes after.
+};
+
+const unsigned int CONTEXTS = 16;
+const uint32_t NOT_FOLLOWED = UINT32_MAX;
+
+bool _holds(Assertion assertion, unsigned int context) {
+    bool left = context & AFTER_WORD_CHAR;
+    bool right = context & BEFORE_WORD_CHAR;
+    switch (assertion) {
+        case AT_START: return context & AFTER_NOTHING;
+        case AT_END: return context & BEFORE_NOTHING;
+        case WORD_BOUNDARY: return left != right;
+        case NOT_WORD_BOUNDARY: return left == right;
+    }
+    return false;
+}
+
+/* The instructions for matching a pattern, either forward or backward. */
+class Program {
+   public:
+    std::vector<Inst> insts;
+    std::vector<CharSet> sets;
+    bool backward;
+    bool has_assertions = false;
+
+    // The instructions which consume or match that each instruction leads to
+    // without consuming anything, in the order of their priority.
+    std::vector<uint32_t> closure_pcs;
+
+    Program(const std::string &pattern, bool backward) : backward(backward) {
+        _compile(Parser(pattern, sets).parse());
+        _emit({MATCH});
+        closures.assign(insts.size() * CONTEXTS, {NOT_FOLLOWED, 0});
+    }
+
+    bool consumes(uint32_t pc, unsigned char c) const {
+        auto &inst = insts[pc];
+        if (inst.op == CHAR) return c == inst.arg;
+        if (inst.op == SET) return sets[inst.arg][c];
+        return false;
+    }
+
+    /* Get where an instruction leads without consuming anything, as the
+    start and end of a range of `closure_pcs`. It is worked out the first
+    time it is needed for each context. */
+    std::pair<uint32_t, uint32_t> follow(uint32_t pc, unsigned int context) {
+        if (!has_assertions) context = 0;
+        auto &closure = closures[pc * CONTEXTS + context];
+        if (closure.first == NOT_FOLLOWED) _follow(pc, context, closure);
+        return closure;
+    }
+
+   private:
+    std::vector<std::pair<uint32_t, uint32_t>> closures;
+
+    size_t _emit(Inst inst) {
+        if (insts.size() == MAX_PROGRAM_SIZE) {
+            throw SyntaxError("pattern is too large");
+        }
+        has_assertions |= inst.op == ASSERT;
+        insts.push_back(inst);
+        return insts.size() - 1;
+    }
+
+    void _compile(const Node &node) {
+        switch (node.kind) {
+            case Node::CHAR:
+                _emit({CHAR, node.arg});
+                break;
+            case Node::SET:
+                _emit({SET, node.arg});
+                break;
+            case Node::ASSERT:
+                _emit({ASSERT, node.arg});
+                break;
+            case Node::CONCAT:
+                if (backward) {
+                    auto &children = node.children;
+                    for (auto i = children.rbegin(); i != children.rend(); i++)
+                        _compile(*i);
+                } else {
+                    for (auto &child : node.children) _compile(child);
+                }
+                break;
+            case Node::ALTERNATE: {
+                std::vector<size_t> jumps;
+                auto last = node.children.size() - 1;
+                for (size_t i = 0; i < last; i++) {
+                    auto split = _emit({SPLIT});
+                    insts[split].x = insts.size();
+                    _compile(node.children[i]);
+                    jumps.push_back(_emit({JUMP}));
+                    insts[split].y = insts.size();
+                }
+                _compile(node.children[last]);
+                for (auto jump : jumps) insts[jump].x = insts.size();
+                break;
+            }
+            case Node::REPEAT:
+                _compile_repeat(node);
+                break;
+        }
+    }
+
+    void _compile_repeat(const Node &node) {
+        auto &child = node.children[0];
+        for (unsigned int i = 0; i < node.min; i++) _compile(child);
+
+        // Each split chooses between going into the child and leaving.
+        std::vector<size_t> splits;
+        if (node.max == UNBOUNDED) {
+            auto split = _emit({SPLIT});
+            splits.push_back(split);
+            _compile(child);
+            _emit({JUMP, 0, (uint32_t)split});
+        } else {
+            for (unsigned int i = node.min; i < node.max; i++) {
+                splits.push_back(_emit({SPLIT}));
+                _compile(child);
+            }
+        }
+
+        uint32_t exit = insts.size();
+        for (auto split : splits) {
+            uint32_t enter = split + 1;
+            insts[split].x = node.greedy ? enter : exit;
+            insts[split].y = node.greedy ? exit : enter;
+        }
+    }
+
+    void _follow(uint32_t pc,
+                 unsigned int context,
+                 std::pair<uint32_t, uint32_t> &closure) {
+        closure.first = closure_pcs.size();
+
+        std::vector<bool> visited(insts.size());
+        std::vector<uint32_t> pending = {pc};
+        while (!pending.empty()) {
+            pc = pending.back();
+            pending.pop_back();
+            if (visited[pc]) continue;
+            visited[pc] = true;
+
+            auto &inst = insts[pc];
+            switch (inst.op) {
+                case SPLIT:
+                    pending.push_back(inst.y);
+                    pending.push_back(inst.x);
+                    break;
+                case JUMP:
+                    pending.push_back(inst.x);
+                    break;
+                case ASSERT:
+                    if (_holds((Assertion)inst.arg, context)) {
+                        pending.push_back(pc + 1);
+                    }
+                    break;
+                default:
+                    closure_pcs.push_back(pc);
+            }
+        }
+
+        closure.second = closure_pcs.size();
+    }
+};
+
+const size_t MAX_DFA_STATES = 512;
+
+/* A DFA which is built from a program while it runs, one state at a time.
+
+A state is the list of instructions the NFA would be at, in the order of their
+priority, before following where they lead. Stepping over a character gives the
+next state, and whether a match ended just before the character. */
+class Dfa {
+   public:
+    // How matches are handled.
+    enum Mode {
+        FIRST,  // Drop everything with a lower priority, like `Regex::search`.
+        ALL,    // Keep going, to find every place a match ends.
+    };
+
+    enum Flags : uint8_t {
+        SEARCHING = 1,  // A match can still start at every character.
+        AT_EDGE = 2,    // Nothing comes before, or after going backward.
+        NEAR_WORD = 4,  // A word character comes before, or after.
+    };
+
+    static constexpr int32_t DEAD = 0;  // The state which never matches.
+    bool failed = false;  // Whether there were too many states.
+
+    Dfa(Program &program, Mode mode) : program(program), mode(mode) {
+        visited.assign(program.insts.size(), 0);
+        _state({}, 0);
+    }
+
+    Dfa(const Dfa &) = delete;
+
+    /* Get the state for a list of instructions, or -1 if it can't be made. */
+    int32_t start(const std::vector<uint32_t> &pcs, uint8_t flags) {
+        return _state(pcs, flags);
+    }
+
+    /* Step over a character, giving the next state shifted left once, with the
+    lowest bit set if a match ended before the character, or -1 if the next
+    state can't be made. */
+    int32_t step(int32_t state, unsigned char c) {
+        auto next = states[state].next[c];
+        return next >= 0 ? next : _transition(state, c);
+    }
+
+    /* Whether or not a match ends at the edge of the text after a state,
+    where `outside` is the context given by what lies beyond the text. */
+    bool ends(int32_t state, unsigned int outside) {
+        auto &current = states[state];
+        auto context = _context(current.flags, outside);
+        if (current.ends[context] < 0) {
+            _expand(current, context);
+            current.ends[context] = false;
+            for (auto pc : list) {
+                if (program.insts[pc].op == MATCH) current.ends[context] = true;
+            }
+        }
+        return current.ends[context];
+    }
+
+   private:
+    struct State {
+        std::vector<uint32_t> pcs;
+        uint8_t flags;
+        int32_t next[256];
+        int8_t ends[CONTEXTS];
+    };
+
+    Program &program;
+    Mode mode;
+
+    std::deque<State> states;
+    std::map<std::pair<uint8_t, std::vector<uint32_t>>, int32_t> ids;
+
+    // Scratch space for making states.
+    std::vector<uint32_t> list, next_pcs;
+    std::vector<size_t> visited;
+    size_t stamp = 0;
+
+    int32_t _state(const std::vector<uint32_t> &pcs, uint8_t flags) {
+        if (!program.has_assertions) flags &= SEARCHING;
+        if (pcs.empty() && !(flags & SEARCHING) && !states.empty()) return DEAD;
+
+        auto key = std::make_pair(flags, pcs);
+        auto pos = ids.find(key);
+        if (pos != ids.end()) return pos->second;
+
+        if (states.size() == MAX_DFA_STATES) {
+            failed = true;
+            states.clear();
+            ids.clear();
+            return -1;
+        }
+
+        states.push_back({pcs, flags, {}, {}});
+        auto &state = states.back();
+        std::fill(std::begin(state.next), std::end(state.next), -1);
+        std::fill(std::begin(state.ends), std::end(state.ends), -1);
+        if (states.size() == 1) {
+            std::fill(std::begin(state.next), std::end(state.next), DEAD);
+        }
+        return ids[key] = states.size() - 1;
+    }
+
+    /* Combine what a state knows with the context given by what lies ahead
+    of it. */
+    unsigned int _context(uint8_t flags, unsigned int ahead) {
+        bool edge = flags & AT_EDGE;
+        bool word = flags & NEAR_WORD;
+        if (program.backward) {
+            return ahead | (edge ? BEFORE_NOTHING : 0) |
+                   (word ? BEFORE_WORD_CHAR : 0);
+        }
+        return ahead | (edge ? AFTER_NOTHING : 0) |
+               (word ? AFTER_WORD_CHAR : 0);
+    }
+
+    /* Put everything the instructions of a state lead to into `list`. */
+    void _expand(const State &state, unsigned int context) {
+        list.clear();
+        stamp++;
+
+        auto add = [&](uint32_t pc) {
+            auto [first, last] = program.follow(pc, context);
+            for (auto i = first; i < last; i++) {
+                auto target = program.closure_pcs[i];
+                if (visited[target] == stamp) continue;
+                visited[target] = stamp;
+                list.push_back(target);
+            }
+        };
+
+        for (auto pc : state.pcs) add(pc);
+        if (state.flags & SEARCHING) add(0);
+    }
+
+    int32_t _transition(int32_t from, unsigned char c) {
+        auto &state = states[from];
+        bool word = WORD_CHARS[c];
+        unsigned int ahead = 0;
+        if (word) ahead = program.backward ? AFTER_WORD_CHAR : BEFORE_WORD_CHAR;
+        _expand(state, _context(state.flags, ahead));
+
+        bool matched = false;
+        uint8_t flags = state.flags & SEARCHING;
+        next_pcs.clear();
+        stamp++;
+        for (auto pc : list) {
+            if (program.insts[pc].op == MATCH) {
+                matched = true;
+                if (mode == ALL) continue;
+                flags = 0;
+                break;
+            }
+            if (program.consumes(pc, c) && visited[pc + 1] != stamp) {
+                visited[pc + 1] = stamp;
+                next_pcs.push_back(pc + 1);
+            }
+        }
+        if (word) flags |= NEAR_WORD;
+
+        auto next = _state(next_pcs, flags);
+        if (next < 0) return -1;
+        return state.next[c] = next << 1 | matched;
+    }
+};
+
+/* A compiled regular expression. */
+class Regex {
+   public:
+    explicit Regex(const std::string &pattern)
+        : forward(pattern, false),
+          backward(pattern, true),
+          first_dfa(forward, Dfa::FIRST),
+          backward_dfa(backward, Dfa::ALL),
+          whole_dfa(forward, Dfa::ALL) {
+        _find_first_chars();
+        seen.assign(forward.insts.size(), 0);
+    }
+
+    Regex(const Regex &) = delete;
+
+    /* Whether or not the whole of a text matches. */
+    bool full_match(const std::string &text) {
+        if (!whole_dfa.failed) {
+            auto state = whole_dfa.start({0}, Dfa::AT_EDGE);
+            for (size_t pos = 0; state >= 0; pos++) {
+                if (state == Dfa::DEAD) return false;
+                if (pos == text.size()) {
+                    return whole_dfa.ends(state, BEFORE_NOTHING);
+                }
+                state = whole_dfa.step(state, text[pos]);
+                if (state >= 0) state >>= 1;
+            }
+        }
+        return _pike_full_match(text);
+    }
+
+    /* Find the leftmost match in a text from `begin` onward, preferring
+    the same match a backtracking engine would find first. */
+    std::optional<Span> search(const std::string &text,
+                               size_t begin,
+                               SearchOptions options = {}) {
+        // The DFAs can't tell empty matches apart, which are rarely ignored.
+        if (!options.not_null && !first_dfa.failed && !backward_dfa.failed) {
+            auto end = _find_end(text, begin, options);
+            if (!first_dfa.failed) {
+                if (!end) return std::nullopt;
+                if (options.continuous) return Span(begin, *end);
+
+                auto start = _find_start(text, begin, *end, options);
+                if (!backward_dfa.failed) return Span(start, *end);
+            }
+        }
+        return _pike_search(text, begin, options);
+    }
+
+    /* Find every match in a text, the same way as `std::regex_iterator`:
+    after an empty match, a longer one is looked for at the same place before
+    moving on. */
+    std::vector<Span> find_all(const std::string &text) {
+        std::vector<Span> spans;
+        SearchOptions options;
+
+        auto match = search(text, 0, options);
+        while (match) {
+            spans.push_back(*match);
+            auto start = match->second;
+
+            if (match->first == match->second) {
+                if (start == text.size()) break;
+
+                auto retry = options;
+                retry.not_null = retry.continuous = true;
+                auto longer = search(text, start, retry);
+                if (longer) {
+                    match = longer;
+                    continue;
+                }
+                start++;
+            }
+
+            options.prev_avail = true;
+            match = search(text, start, options);
+        }
+        return spans;
+    }
+
+   private:
+    struct Thread {
+        uint32_t pc;
+        size_t start;
+    };
+
+    Program forward;
+    Program backward;
+
+    Dfa first_dfa;     // Finds where the leftmost match ends.
+    Dfa backward_dfa;  // Finds where a match ending somewhere starts.
+    Dfa whole_dfa;     // Finds whether the whole text matches.
+
+    CharSet first_chars;  // The characters a non-empty match can start with.
+    bool matches_empty = false;
+
+    // Scratch space for running the NFA.
+    std::vector<Thread> clist, nlist;
+    std::vector<size_t> seen;  // The stamp of the last visit to each pc.
+    size_t stamp = 0;
+
+    /* Work out which characters a match can start with, going through the
+    program the same way as `Program::follow` without checking assertions. */
+    void _find_first_chars() {
+        std::vector<bool> visited(forward.insts.size());
+        std::vector<uint32_t> pending = {0};
+
+        while (!pending.empty()) {
+            auto pc = pending.back();
+            pending.pop_back();
+            if (visited[pc]) continue;
+            visited[pc] = true;
+
+            auto &inst = forward.insts[pc];
+            switch (inst.op) {
+                case CHAR: first_chars.set(inst.arg); break;
+                case SET: first_chars |= forward.sets[inst.arg]; break;
+                case ASSERT: pending.push_back(pc + 1); break;
+                case SPLIT:
+                    pending.push_back(inst.x);
+                    pending.push_back(inst.y);
+                    break;
+                case JUMP: pending.push_back(inst.x); break;
+                case MATCH: matches_empty = true; break;
+            }
+        }
+    }
+
+    size_t _skip_to_first(const std::string &text, size_t pos) {
+        size_t end = text.size();
+        if (first_chars.count() == 1) {
+            unsigned char c = 0;
+            while (!first_chars[c]) c++;
+            auto found = memchr(text.data() + pos, c, end - pos);
+            return found ? (const char *)found - text.data() : end;
+        }
+        while (pos < end && !first_chars[(unsigned char)text[pos]]) pos++;
+        return pos;
+    }
+
+    bool _is_word(const std::string &text, size_t pos) {
+        return WORD_CHARS[(unsigned char)text[pos]];
+    }
+
+    /* Find where the leftmost match from `begin` ends with the DFA. */
+    std::optional<size_t> _find_end(const std::string &text,
+                                    size_t begin,
+                                    const SearchOptions &options) {
+        std::vector<uint32_t> pcs;
+        uint8_t flags = Dfa::SEARCHING;
+        if (options.continuous) pcs = {0}, flags = 0;
+        if (!options.prev_avail) flags |= Dfa::AT_EDGE;
+        if (options.prev_avail && begin && _is_word(text, begin - 1)) {
+            flags |= Dfa::NEAR_WORD;
+        }
+
+        auto state = first_dfa.start(pcs, flags);
+        if (state < 0) return std::nullopt;
+
+        // Nothing can match until one of the first characters.
+        int32_t idle = -1;
+        if (!matches_empty && !forward.has_assertions) {
+            idle = first_dfa.start({}, Dfa::SEARCHING);
+        }
+
+        std::optional<size_t> end;
+        size_t size = text.size();
+        for (size_t pos = begin; pos < size; pos++) {
+            if (state == idle) {
+                pos = _skip_to_first(text, pos);
+                if (pos == size) return end;
+            }
+
+            auto next = first_dfa.step(state, text[pos]);
+            if (next < 0) return std::nullopt;
+            if (next & 1) end = pos;
+            state = next >> 1;
+            if (state == Dfa::DEAD) return end;
+        }
+
+        if (first_dfa.ends(state, BEFORE_NOTHING)) end = size;
+        return end;
+    }
+
+    /* Find where the leftmost match ending at `end` starts, by going
+    backward from the end with the DFA for the reversed pattern. */
+    size_t _find_start(const std::string &text,
+                       size_t begin,
+                       size_t end,
+                       const SearchOptions &options) {
+        uint8_t flags = 0;
+        if (end == text.size()) flags |= Dfa::AT_EDGE;
+        if (end < text.size() && _is_word(text, end)) flags |= Dfa::NEAR_WORD;
+
+        auto state = backward_dfa.start({0}, flags);
+        if (state < 0) return 0;
+
+        size_t start = end;
+        for (size_t pos = end; pos > begin; pos--) {
+            auto next = backward_dfa.step(state, text[pos - 1]);
+            if (next < 0) return 0;
+            if (next & 1) start = pos;
+            state = next >> 1;
+            if (state == Dfa::DEAD) return start;
+        }
+
+        unsigned int outside = 0;
+        if (!options.prev_avail) outside |= AFTER_NOTHING;
+        if (options.prev_avail && begin && _is_word(text, begin - 1)) {
+            outside |= AFTER_WORD_CHAR;
+        }
+        if (backward_dfa.ends(state, outside)) start = begin;
+        return start;
+    }
+
+    unsigned int _context(const std::string &text,
+                          size_t pos,
+                          size_t begin,
+                          const SearchOptions &options) {
+        if (!forward.has_assertions) return 0;
+
+        bool has_prev = pos != begin || options.prev_avail;
+        unsigned int context = 0;
+        if (!has_prev) context |= AFTER_NOTHING;
+        if (pos == text.size()) context |= BEFORE_NOTHING;
+        if (has_prev && pos && _is_word(text, pos - 1)) {
+            context |= AFTER_WORD_CHAR;
+        }
+        if (pos < text.size() && _is_word(text, pos)) {
+            context |= BEFORE_WORD_CHAR;
+        }
+        return context;
+    }
+
+    /* Add a thread for everything an instruction leads to to a list, in the
+    order of their priority, unless the list already has one. */
+    void _add_thread(std::vector<Thread> &list,
+                     uint32_t pc,
+                     size_t start,
+                     unsigned int context) {
+        auto [first, last] = forward.follow(pc, context);
+        for (auto i = first; i < last; i++) {
+            auto target = forward.closure_pcs[i];
+            if (seen[target] == stamp) continue;
+            seen[target] = stamp;
+            list.push_back({target, start});
+        }
+    }
+
+    /* Run the NFA to find whether the whole of a text matches. */
+    bool _pike_full_match(const std::string &text) {
+        size_t end = text.size();
+        SearchOptions options;
+
+        clist.clear();
+        stamp++;
+        _add_thread(clist, 0, 0, _context(text, 0, 0, options));
+
+        for (size_t pos = 0; !clist.empty(); pos++) {
+            if (pos == end) {
+                for (auto thread : clist) {
+                    if (forward.insts[thread.pc].op == MATCH) return true;
+                }
+                break;
+            }
+
+            nlist.clear();
+            stamp++;
+            auto context = _context(text, pos + 1, 0, options);
+            for (auto thread : clist) {
+                if (forward.consumes(thread.pc, text[pos])) {
+                    _add_thread(nlist, thread.pc + 1, 0, context);
+                }
+            }
+            std::swap(clist, nlist);
+        }
+        return false;
+    }
+
+    /* Run the NFA to find the leftmost match from `begin` onward. */
+    std::optional<Span> _pike_search(const std::string &text,
+                                     size_t begin,
+                                     const SearchOptions &options) {
+        size_t end = text.size();
+        std::optional<Span> found;
+
+        clist.clear();
+        stamp++;
+
+        for (size_t pos = begin;; pos++) {
+            if (!found && (!options.continuous || pos == begin)) {
+                if (clist.empty() && !matches_empty && !options.continuous) {
+                    pos = _skip_to_first(text, pos);
+                    if (pos == end) break;
+                }
+                _add_thread(
+                    clist, 0, pos, _context(text, pos, begin, options));
+            }
+            if (clist.empty() && (found || options.continuous)) break;
+
+            nlist.clear();
+            stamp++;
+            auto context = _context(text, pos + 1, begin, options);
+            for (auto thread : clist) {
+                if (forward.insts[thread.pc].op == MATCH) {
+                    if (options.not_null && thread.start == pos) continue;
+                    // Threads after this one have a lower priority.
+                    found = {thread.start, pos};
+                    break;
+                }
+                if (pos < end && forward.consumes(thread.pc, text[pos])) {
+                    _add_thread(nlist, thread.pc + 1, thread.start, context);
+                }
+            }
+            if (pos == end) break;
+            std::swap(clist, nlist);
+        }
+
+        return found;
+    }
+};
+
+}  // namespace nfa
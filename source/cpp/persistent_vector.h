@@ -0,0 +1,173 @@
+/* A vector which is copied in constant time and shares its memory with its
+copies.
+
+The items live in the leaves of a trie where every node has up to 32 children,
+so an item is found by reading its index five bits at a time, starting from the
+root. Nodes are reference counted, and a node held by more than one vector is
+copied before it's changed, so changing a vector never changes its copies. Only
+the nodes on the path to the changed item are copied, which makes pushing onto
+a copy, replacing one of its items or slicing it take O(log32 n) time.
+
+A slice keeps the whole trie it was taken from, and only remembers where its
+first item is and how many items it has. Items past its end are overwritten by
+later pushes, but the items before its start are kept until the slice is
+freed. */
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+template <class T>
+class PersistentVector {
+   public:
+    static constexpr unsigned int BITS = 5;
+    static constexpr size_t WIDTH = 1 << BITS;
+    static constexpr size_t MASK = WIDTH - 1;
+
+    /* Iterates over copies of the items, since they may be shared. */
+    class iterator {
+       public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T *;
+        using reference = T;
+
+        iterator(const PersistentVector *vector, size_t index)
+            : vector(vector), index(index) {}
+
+        T operator*() const { return (*vector)[index]; }
+        iterator &operator++() {
+            index++;
+            return *this;
+        }
+        bool operator==(const iterator &other) const {
+            return index == other.index;
+        }
+        bool operator!=(const iterator &other) const {
+            return index != other.index;
+        }
+
+       private:
+        const PersistentVector *vector;
+        size_t index;
+    };
+
+    size_t size() const { return count; }
+    bool empty() const { return !count; }
+
+    iterator begin() const { return {this, 0}; }
+    iterator end() const { return {this, count}; }
+
+    T operator[](size_t index) const { return *_find(origin + index); }
+    T front() const { return (*this)[0]; }
+    T back() const { return (*this)[count - 1]; }
+
+    void push_back(const T &item) {
+        size_t position = origin + count;
+        if (!root) {
+            root = std::make_shared<Node>();
+        } else if (position >> shift >= WIDTH) {
+            // The trie is full, so it grows a level at the top.
+            auto top = std::make_shared<Node>();
+            top->children.push_back(root);
+            root = top;
+            shift += BITS;
+        }
+
+        auto node = _unique(root);
+        for (auto level = shift; level; level -= BITS) {
+            auto &children = node->children;
+            size_t child = (position >> level) & MASK;
+
+            // Whatever is at or past the end was left by a pop or a slice.
+            children.resize(child + 1);
+            if (!children[child]) children[child] = std::make_shared<Node>();
+            node = _unique(children[child]);
+        }
+        node->items.resize(position & MASK);
+        node->items.push_back(item);
+        count++;
+    }
+
+    void pop_back() {
+        if (!--count) clear();
+    }
+
+    /* Remove the first item, leaving the rest where they are. */
+    void pop_front() {
+        origin++;
+        if (!--count) clear();
+    }
+
+    /* Add an item before the first one. This only takes O(log32 n) time when
+    the slot before the first item is free, such as after `pop_front`. */
+    void push_front(const T &item) {
+        if (!origin) {
+            PersistentVector<T> moved;
+            moved.push_back(item);
+            for (auto old : *this) moved.push_back(old);
+            *this = moved;
+            return;
+        }
+        origin--;
+        count++;
+        set(0, item);
+    }
+
+    /* Replace the item at an index. */
+    void set(size_t index, const T &item) {
+        size_t position = origin + index;
+        auto node = _unique(root);
+        for (auto level = shift; level; level -= BITS) {
+            node = _unique(node->children[(position >> level) & MASK]);
+        }
+        node->items[position & MASK] = item;
+    }
+
+    /* Get the items from `start` up to but not including `stop`. */
+    PersistentVector<T> slice(size_t start, size_t stop) const {
+        PersistentVector<T> output;
+        if (start >= stop) return output;
+
+        output = *this;
+        output.origin += start;
+        output.count = stop - start;
+        return output;
+    }
+
+    void clear() {
+        root = nullptr;
+        shift = 0;
+        origin = 0;
+        count = 0;
+    }
+
+   private:
+    /* Branches only have children, and leaves only have items. */
+    struct Node {
+        std::vector<std::shared_ptr<Node>> children;
+        std::vector<T> items;
+    };
+
+    std::shared_ptr<Node> root;
+    // The number of index bits below the root's children.
+    unsigned int shift = 0;
+    // The position in the trie of the first item.
+    size_t origin = 0;
+    size_t count = 0;
+
+    const T *_find(size_t position) const {
+        auto node = root.get();
+        for (auto level = shift; level; level -= BITS) {
+            node = node->children[(position >> level) & MASK].get();
+        }
+        return &node->items[position & MASK];
+    }
+
+    /* Get a node which no other vector holds, copying it if it's shared. */
+    static Node *_unique(std::shared_ptr<Node> &node) {
+        if (node.use_count() > 1) node = std::make_shared<Node>(*node);
+        return node.get();
+    }
+};
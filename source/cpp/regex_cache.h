@@ -0,0 +1,87 @@
+/* Keeps compiled regular expressions around, so that builtins which are given
+the same pattern over and over only compile it once.
+
+Patterns given as strings go into a small cache which forgets the least
+recently used pattern when it is full. Patterns compiled by the `regex` builtin
+are kept for the rest of the program instead, and REGEX values refer to them
+by their index. */
+#include <deque>
+#include <iostream>
+#include <list>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+
+#include "./nfa.h"
+
+const size_t REGEX_CACHE_SIZE = 64;
+
+/* The most recently used compiled patterns. */
+class RegexCache {
+   public:
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+
+    /* Get a pattern compiled, compiling it if it isn't in the cache.
+
+    Throws `nfa::SyntaxError` if the pattern is invalid. The result is only
+    valid until the next call. */
+    nfa::Regex *get(const std::string &pattern) {
+        auto pos = index.find(pattern);
+        if (pos != index.end()) {
+            hits++;
+            entries.splice(entries.begin(), entries, pos->second);
+            return &pos->second->second;
+        }
+
+        misses++;
+        // Regexes can't be moved, so they are compiled in place.
+        entries.emplace_front(std::piecewise_construct,
+                              std::forward_as_tuple(pattern),
+                              std::forward_as_tuple(pattern));
+        if (entries.size() > REGEX_CACHE_SIZE) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        index[pattern] = entries.begin();
+        return &entries.front().second;
+    }
+
+    void print_stats() {
+        std::cerr << "[DEBUG] Regex cache: " << hits << " hits, " << misses
+                  << " misses.\n";
+    }
+
+   private:
+    // Most recently used first.
+    std::list<std::pair<std::string, nfa::Regex>> entries;
+    std::unordered_map<std::string,
+                       std::list<std::pair<std::string, nfa::Regex>>::iterator>
+        index;
+};
+
+/* The patterns of REGEX values, which are never freed. */
+class RegexTable {
+   public:
+    std::deque<std::string> patterns;
+    std::deque<nfa::Regex> compiled;
+
+    /* Get the index of a compiled pattern, compiling it the first time.
+
+    Throws `nfa::SyntaxError` if the pattern is invalid. */
+    unsigned int intern(const std::string &pattern) {
+        auto pos = ids.find(pattern);
+        if (pos != ids.end()) return pos->second;
+
+        compiled.emplace_back(pattern);
+        patterns.push_back(pattern);
+        return ids[pattern] = compiled.size() - 1;
+    }
+
+   private:
+    std::unordered_map<std::string, unsigned int> ids;
+};
+
+RegexCache REGEX_CACHE;
+RegexTable REGEXES;
@@ -1,17 +1,29 @@
 /* Provides runtime variable resolution in the lisp.*/
 #include <forward_list>
 #include <iostream>
-#include <map>
 #include <sstream>
 #include <vector>
 
+#include "./symbols.h"
+
 /* A scoped implementation of variables for a programming language running in a
 CPP virtual machine.
 
-The namespaces are implemented as a map from variable names to a forward list
-of ValueAndDepth objects. The depth should be incremented every time a
+Every variable name is resolved once to a slot, which is its symbol in
+`SYMBOLS` and so an index into a flat table. Each slot holds a forward list of
+ValueAndDepth objects, so looking up a variable is an array index instead of a
+search by name. The depth should be incremented every time a
 function/subroutine is called.
 
+The slots bound at each depth are kept in an undo log, so leaving a depth only
+pops the bindings made in it instead of going through every slot.
+
+A binding can own its value, which means nothing else refers to the value.
+Reading the variable with `get_var` gives the ownership up, since the value may
+then be stored somewhere else. Reading it with `take_var` lends the ownership to
+an update which is about to rebind the variable, and any other read in between
+still gives it up.
+
 The namespace takes one template argument, which is the type of the variable
 values.
 
@@ -19,96 +31,121 @@ values.
 template <class T>
 class VariableScope {
    public:
+    enum Ownership { SHARED, OWNED, TAKEN };
+
     struct ValueAndDepth {
         T value;
         unsigned int depth;
+        Ownership ownership;
     };
 
-    std::map<std::string, std::forward_list<ValueAndDepth>> scopes;
+    std::vector<std::forward_list<ValueAndDepth>> scopes;
+    std::vector<std::vector<unsigned int>> undo_log;  // Slots bound per depth.
     unsigned int depth;
 
     /* Increment the scope depth. */
     void increment() { this->depth++; }
 
-    /* Decrement the scope depth. */
+    /* Decrement the scope depth, removing the variables set in it. */
     void decrement() {
+        if (this->depth < this->undo_log.size()) {
+            auto bound = &this->undo_log[this->depth];
+            for (auto slot : *bound) this->scopes[slot].pop_front();
+            bound->clear();
+        }
         this->depth--;
-        this->clean_scope();
+    }
+
+    /* Get the slot of a variable name, giving it a new one if it has none. */
+    unsigned int resolve(std::string_view varname) {
+        return this->resolve(SYMBOLS.intern(varname));
+    }
+
+    /* Get the slot of the variable named by a symbol. */
+    unsigned int resolve(uint32_t symbol) {
+        if (symbol >= this->scopes.size()) this->scopes.resize(symbol + 1);
+        return symbol;
     }
 
     /* Get whether or not the variable is set.*/
-    bool is_set(std::string* varname) {
-        auto pos = this->scopes.find(*varname);
-        return pos != this->scopes.end();
+    bool is_set(unsigned int slot) { return !this->scopes[slot].empty(); }
+
+    /* Get the value of the variable in a slot. Throws runtime_error if the
+     * variable has not been set. */
+    T get_var(unsigned int slot) {
+        auto binding = this->_binding(slot);
+        binding->ownership = SHARED;
+        return binding->value;
     }
 
-    /* Get the value of the variable name. Throws runtime_error if the variable
-     * has not been set. */
-    T get_var(std::string* varname) {
-        auto pos = this->scopes.find(*varname);
+    /* Get the value of a variable which is about to be rebound, lending its
+     * ownership to whatever rebinds it. */
+    T take_var(unsigned int slot) {
+        auto binding = this->_binding(slot);
+        binding->ownership = binding->ownership == OWNED ? TAKEN : SHARED;
+        return binding->value;
+    }
 
-        if (pos == this->scopes.end()) {
-            throw std::runtime_error("Could not resolve variable name '" +
-                                     *varname + "'");
-        }
+    /* Get the value of a variable without changing its ownership. */
+    T peek_var(unsigned int slot) { return this->_binding(slot)->value; }
 
-        return pos->second.front().value;
+    /* Get whether or not the value taken from a variable bound in the current
+     * scope is still referred to by nothing else. */
+    bool is_taken(unsigned int slot) {
+        auto values = &this->scopes[slot];
+        return !values->empty() && values->front().ownership == TAKEN &&
+               values->front().depth == this->depth;
     }
 
     /* Get the variable or a fallback value if it isn't set.*/
-    T get_var_or(std::string* varname, T fallback) {
-        if (this->is_set(varname)) { return this->get_var(varname); }
+    T get_var_or(unsigned int slot, T fallback) {
+        if (this->is_set(slot)) { return this->get_var(slot); }
         return fallback;
     }
 
-    /* Insert a new forward list if none is avaliable or push
-    the value onto the front of the avaliable list. */
-    void set_var(std::string* varname, T value) {
-        auto pos = this->scopes.find(*varname);
-        ValueAndDepth item = {value, this->depth};
-
-        if (pos == this->scopes.end()) {
-            this->scopes[*varname] = {item};
-        } else {
-            // Discards the value if it has already been set in this scope.
-            if (this->scopes[*varname].front().depth == this->depth) {
-                this->scopes[*varname].pop_front();
-            }
-            this->scopes[*varname].push_front(item);
+    /* Push the value onto the front of the list of the slot. */
+    void set_var(unsigned int slot, T value, bool owned = false) {
+        auto values = &this->scopes[slot];
+        ValueAndDepth item = {value, this->depth, owned ? OWNED : SHARED};
+
+        // Discards the value if it has already been set in this scope.
+        if (!values->empty() && values->front().depth == this->depth) {
+            values->front() = item;
+            return;
+        }
+
+        if (this->undo_log.size() <= this->depth) {
+            this->undo_log.resize(this->depth + 1);
         }
+        this->undo_log[this->depth].push_back(slot);
+        values->push_front(item);
     }
 
-    /* Get the total number of variables stored in the map. */
+    /* Get the slots of the variables set at the current depth. */
+    std::vector<unsigned int> local_slots() {
+        if (this->depth >= this->undo_log.size()) return {};
+        return this->undo_log[this->depth];
+    }
+
+    /* Get the total number of variables stored in the table. */
     unsigned int tally() {
         unsigned int acc = 0;
 
         for (auto x : this->scopes) {
-            acc += std::distance(x.second.begin(), x.second.end());
+            acc += std::distance(x.begin(), x.end());
         }
         return acc;
     }
 
    private:
-    /* Remove variables which have gone out of scope. */
-    void clean_scope() {
-        for (auto it = this->scopes.begin(); it != this->scopes.end();) {
-            auto values = &it->second;
-            if (values->front().depth > this->depth) {
-                // Remove definitions that have gone out of scope.
-                while (!values->empty() &&
-                       values->front().depth > this->depth) {
-                    values->pop_front();
-                }
-
-                // Remove the forward list entirely if the variable is no longer
-                // defined. Required iterator magic is based on
-                // https://stackoverflow.com/a/8234813.
-                if (values->empty()) {
-                    this->scopes.erase(it++);
-                    continue;
-                }
-            }
-            it++;
+    ValueAndDepth *_binding(unsigned int slot) {
+        auto values = &this->scopes[slot];
+
+        if (values->empty()) {
+            throw std::runtime_error("Could not resolve variable name '" +
+                                     SYMBOLS.name(slot) + "'");
         }
+
+        return &values->front();
     }
 };
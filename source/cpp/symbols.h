@@ -0,0 +1,41 @@
+/* Gives every name read by the parser a number, so that it's only hashed once
+when it's read, and is looked up by its number from then on.
+
+The builtins are interned first, in the order of `LispBuiltin`, so the symbol of
+the name of a builtin is the builtin itself. Variables are numbered by their
+symbols too. */
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class SymbolTable {
+   public:
+    /* Start with the names given, numbered in order. */
+    SymbolTable(const std::vector<std::string> &first) {
+        for (auto &name : first) intern(name);
+    }
+
+    /* Get the symbol of a name, giving it a new one if it has none. */
+    uint32_t intern(std::string_view name) {
+        auto pos = symbols.find(name);
+        if (pos != symbols.end()) return pos->second;
+
+        // The names never move, so the keys can refer to them.
+        uint32_t symbol = names.size();
+        names.emplace_back(name);
+        symbols.emplace(names.back(), symbol);
+        return symbol;
+    }
+
+    const std::string &name(uint32_t symbol) const { return names[symbol]; }
+    size_t size() const { return names.size(); }
+
+   private:
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, uint32_t> symbols;
+};
+
+SymbolTable SYMBOLS(BUILTINS_NAMES);
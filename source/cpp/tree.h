@@ -27,6 +27,19 @@ class Tree {
         return result;
     }
 
+    /* Returns the indices of the direct children of a node. */
+    std::vector<unsigned int> children(unsigned int index) {
+        std::vector<unsigned int> result;
+        auto base_depth = this->depths[index];
+        auto size = this->size();
+
+        for (size_t i = index + 1; (i < size) && (depths[i] > base_depth);
+             i++) {
+            if (depths[i] == base_depth + 1) result.push_back(i);
+        }
+        return result;
+    }
+
     bool operator==(Tree<T> *tree) {
         unsigned int size = this->size();
         for (size_t i = 0; i < size; i++) {
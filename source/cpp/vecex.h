@@ -1,4 +1,5 @@
 /* Implements regular expression-like operations for vectors of any type. */
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <functional>
@@ -7,6 +8,8 @@
 #include <optional>
 #include <sstream>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -46,18 +49,6 @@ struct uint_inf {
 
 uint_inf U_INFINITY = {0, true};
 
-/* A vector expression match. */
-template <typename T>
-class Match {
-   public:
-    std::optional<uint> count;  // Number of items matched.
-    bool exhausted;             // Whether or not the expression was exhausted.
-
-    bool is_good() { return count.has_value() && exhausted; }
-    uint value() { return count.value(); }
-    uint value_or(uint a) { return count.value_or(a); }
-};
-
 /* A vector expression token. */
 template <typename T>
 class Token {
@@ -86,21 +77,6 @@ class Token {
         }
     }
 
-    Token<T> normal() { return {JUST, tokens}; }
-
-    /* If the group is capturing, add the captures to the CaptureMapper. */
-    template <typename A>
-    void update_captures(CaptureMapper<A>* map,
-                         std::vector<A>* items,
-                         uint start,
-                         uint end) {
-        if (!is_capturing()) return;
-
-        auto name = groupname.value();
-        if (map->find(name) == map->end()) (*map)[name] = {};
-        (*map)[name].push_back({items->begin() + start, items->begin() + end});
-    }
-
     std::string str() {
         auto n_tokens = tokens.size();
         if (tag != DOT && !n_tokens) return "";
@@ -148,128 +124,462 @@ class Token {
     }
 };
 
-/* Match a vector expression token against a vector, returning
-   its captures if it is successful, or `Nothing` otherwise.
+/* Whether or not literals of a type can be compared with `==`. */
+template <typename A, typename = void>
+struct is_comparable : std::false_type {};
+
+template <typename A>
+struct is_comparable<
+    A,
+    std::void_t<decltype(std::declval<A>() == std::declval<A>())>>
+    : std::true_type {};
+
+enum Op {
+    ITEM,     // Consume an item matching literal `arg`.
+    ANY,      // Consume any item.
+    SOME,     // Consume an item matching one of `y` item literals from `arg`.
+    EVERY,    // Consume an item matching all `y` item literals from `arg`.
+    SPLIT,    // Go to `arg` first, then to `y`.
+    JUMP,     // Go to `arg`.
+    OPEN,     // Start capturing group `arg`.
+    CLOSE,    // Finish capturing group `arg`.
+    MATCH,    // Match if every item has been consumed.
+};
 
-   The template type `A` is the type of the token, and the type `T` is the type
-   of the items.
+struct Inst {
+    Op op;
+    uint arg = 0;
+    uint y = 0;
+};
 
-   One example use case is having some complex nested numeric conditions (`>`,
-   `<` for example) that a vector of `int` needs to be compared against.
+/* A vector expression token compiled into a flat program, which is matched by
+following every way of matching at once, one item at a time.
 
-   One way to implement this would be having `A` as the type `bool(int)`, and
-   creating the closures along with the tokens. The `matches` function here
-   could be function application of the first argument on the second.
+Matching takes time linear in the number of items, and the program can be kept
+and matched against any number of vectors. Where there are several ways of
+matching, the one a backtracking matcher would find first is kept: repeats are
+greedy, and earlier alternatives win.
 
-   Another way to implement this would be having `A` as the type `std::string`.
-   For example, the condition needing to be greater than 10 could be written as
-   `">10"`. Here, the `matches` function could be getting the operator from the
-   first string character, and then applying it on the rest of the string and
-   the second argument.
- */
-template <typename A, typename T>
-std::optional<CaptureMapper<T>> fullmatch(Token<A>* token,
-                                          std::vector<T>* items,
-                                          Comparer<A, T>* matches) {
-    CaptureMapper<T> captures = {};
+Programs without groups only need to tell whether a vector matches, so their
+sets of threads are turned into the states of a DFA as they are met. Each item
+is then only compared with the literals of the current state once.
+
+The template type `A` is the type of the literals in the tokens. */
+template <typename A>
+class Program {
+   public:
+    explicit Program(Token<A>* token) {
+        _compile(token);
+        _emit({MATCH});
+        if (groupnames.empty()) _follow_all();
+    }
+
+    /* Match a whole vector, returning its captures if it is successful, or
+    `Nothing` otherwise.
+
+    The template type `T` is the type of the items, which are compared with
+    the literals by `matches`.
+
+    One example use case is having some complex nested numeric conditions
+    (`>`, `<` for example) that a vector of `int` needs to be compared against.
+
+    One way to implement this would be having `A` as the type `bool(int)`, and
+    creating the closures along with the tokens. The `matches` function here
+    could be function application of the first argument on the second.
+
+    Another way to implement this would be having `A` as the type
+    `std::string`. For example, the condition needing to be greater than 10
+    could be written as `">10"`. Here, the `matches` function could be getting
+    the operator from the first string character, and then applying it on the
+    rest of the string and the second argument. */
+    template <typename T>
+    std::optional<CaptureMapper<T>> fullmatch(std::vector<T>* items,
+                                              Comparer<A, T>* matches) {
+        // Without groups, only whether or not the vector matches is needed.
+        if (groupnames.empty() && !dfa_failed) {
+            auto matched = _dfa_match(items, matches);
+            if (matched.has_value()) {
+                if (!matched.value()) return {};
+                return CaptureMapper<T>{};
+            }
+        }
 
-    std::function<Match<T>(Token<A>*, uint)> inner;
-    inner = [&items, &captures, &matches, &inner](Token<A>* token,
-                                                  uint old_index) -> Match<T> {
-        assert(token->is_valid());
-        uint i_items = old_index;
-        uint i_tokens = 0;
         uint num_items = items->size();
-        uint num_tokens = token->tokens.size();
-
-        if (token->tag == JUST) {
-            for (; i_tokens < num_tokens; i_tokens++) {
-                auto subtoken = token->tokens[i_tokens];
-                bool is_literal = std::holds_alternative<A>(subtoken);
-                if (is_literal) {
-                    if (i_items >= num_items) break;  // Items are exhausted.
-                    auto expected = std::get<A>(subtoken);
-                    auto actual = (*items)[i_items];
-
-                    if (!(*matches)(expected, actual)) break;  // No match.
-                    i_items++;
-
-                } else {
-                    // Recursively match the subtoken.
-                    auto result = inner(std::get<1>(subtoken), i_items);
-                    if (!result.is_good()) break;
-                    i_items += result.value();
+        events.clear();
+        clist.clear();
+        seen.assign(insts.size(), 0);
+        tested.assign(literals.size(), 0);
+        results.resize(literals.size());
+        stamp = 1;
+        _add_thread(clist, 0, NO_EVENT, 0);
+
+        for (uint i = 0; i < num_items && !clist.empty(); i++) {
+            nlist.clear();
+            stamp++;
+            auto& item = (*items)[i];
+            for (auto thread : clist) {
+                if (_consumes(insts[thread.pc], item, matches)) {
+                    _add_thread(nlist, thread.pc + 1, thread.events, i + 1);
                 }
             }
-            bool exhausted = i_tokens == num_tokens;
-            if (exhausted)
-                token->update_captures(&captures, items, old_index, i_items);
-            return {i_items - old_index, exhausted};
+            std::swap(clist, nlist);
+        }
+
+        // The threads are in order of priority.
+        for (auto thread : clist) {
+            if (insts[thread.pc].op == MATCH) {
+                return _captures(thread.events, items);
+            }
+        }
+        return {};
+    }
+
+   private:
+    // A group being opened or closed, which is shared by every thread that
+    // went through it.
+    struct Event {
+        uint group;
+        uint index;
+        bool closes;
+        int previous;
+    };
+
+    struct Thread {
+        uint pc;
+        int events;  // The last event, or NO_EVENT.
+    };
+
+    // A set of threads, which goes to another set depending on which of its
+    // literals the next item matches.
+    struct State {
+        std::vector<uint> pcs;
+        std::vector<uint> tests;  // The literals compared with items.
+        bool accepts = false;
+        std::vector<int> next;  // For each result of the tests, or -1.
+    };
+
+    static constexpr int NO_EVENT = -1;
+    static constexpr uint MAX_STATES = 256;
+    static constexpr uint MAX_TESTS = 8;
+
+    std::vector<Inst> insts;
+    std::vector<A> literals;
+    std::vector<uint> item_literals;  // The literals of SOME and EVERY.
+    std::vector<std::string> groupnames;
+
+    // Scratch space for matching.
+    std::vector<Event> events;
+    std::vector<Thread> clist, nlist, pending;
+    std::vector<uint> seen;  // The stamp of the last visit to each pc.
+    uint stamp = 0;
+
+    // Each literal is only compared with an item once, as several threads
+    // often test the same one.
+    std::vector<uint> tested;  // The stamp of the last test of each literal.
+    std::vector<bool> results;
+
+    // Without groups, where each instruction leads is always the same, so it
+    // is worked out once, as ranges of `closure_pcs`.
+    std::vector<uint> closure_pcs;
+    std::vector<std::pair<uint, uint>> closures;
+
+    std::vector<State> states;
+    std::map<std::vector<uint>, int> state_ids;
+    bool dfa_failed = false;  // Whether there were too many states or tests.
+
+    uint _emit(Inst inst) {
+        insts.push_back(inst);
+        return insts.size() - 1;
+    }
+
+    /* Get the index of a literal, reusing an equal one if possible. */
+    uint _literal(const A& value) {
+        if constexpr (is_comparable<A>::value) {
+            for (uint i = 0; i < literals.size(); i++) {
+                if (literals[i] == value) return i;
+            }
+        }
+        literals.push_back(value);
+        return literals.size() - 1;
+    }
+
+    /* Emit an instruction consuming one item, with the literals of a token. */
+    void _compile_item(Op op, Token<A>* token) {
+        uint first = item_literals.size();
+        for (auto subtoken : token->tokens) {
+            item_literals.push_back(_literal(std::get<A>(subtoken)));
+        }
+        _emit({op, first, (uint)token->tokens.size()});
+    }
+
+    void _compile_sequence(Token<A>* token) {
+        for (auto subtoken : token->tokens) {
+            if (std::holds_alternative<A>(subtoken)) {
+                _emit({ITEM, _literal(std::get<A>(subtoken))});
+            } else {
+                _compile(std::get<1>(subtoken));
+            }
         }
+    }
+
+    void _compile(Token<A>* token) {
+        assert(token->is_valid());
+
+        uint group = 0;
+        if (token->is_capturing()) {
+            group = groupnames.size();
+            groupnames.push_back(token->groupname.value());
+            _emit({OPEN, group});
+        }
+
+        switch (token->tag) {
+            case JUST: _compile_sequence(token); break;
+            case DOT: _emit({ANY}); break;
+            case UNION: _compile_item(SOME, token); break;
+            case INTERSECTION: _compile_item(EVERY, token); break;
+            case BETWEEN: _compile_between(token); break;
+        }
+
+        if (token->is_capturing()) _emit({CLOSE, group});
+    }
 
-        if (token->tag == DOT) {
-            if (i_items >= num_items) return {0, false};
-            token->update_captures(&captures, items, old_index, old_index + 1);
-            return {1, true};
+    /* Compile the subtokens of a token repeated between its min and max
+    number of times, preferring more repeats. */
+    void _compile_between(Token<A>* token) {
+        uint min = token->min.num_or(0);
+        for (uint i = 0; i < min; i++) _compile_sequence(token);
+
+        std::vector<uint> splits;
+        if (token->max.is_inf) {
+            auto split = _emit({SPLIT});
+            splits.push_back(split);
+            _compile_sequence(token);
+            _emit({JUMP, split});
+        } else {
+            for (uint i = min; i < token->max.num; i++) {
+                splits.push_back(_emit({SPLIT}));
+                _compile_sequence(token);
+            }
         }
 
-        if (token->tag == UNION) {
-            if (i_items >= num_items) return {};
-            for (auto item : token->tokens) {
-                auto expected = std::get<A>(item);
-                auto actual = (*items)[i_items];
-                if ((*matches)(expected, actual)) {
-                    token->update_captures(
-                        &captures, items, old_index, old_index + 1);
-                    return {1, true};
+        for (auto split : splits) {
+            insts[split].arg = split + 1;
+            insts[split].y = insts.size();
+        }
+    }
+
+    template <typename T>
+    bool _test(uint literal, T& item, Comparer<A, T>* matches) {
+        if (tested[literal] != stamp) {
+            tested[literal] = stamp;
+            results[literal] = (*matches)(literals[literal], item);
+        }
+        return results[literal];
+    }
+
+    template <typename T>
+    bool _consumes(const Inst& inst, T& item, Comparer<A, T>* matches) {
+        switch (inst.op) {
+            case ITEM: return _test(inst.arg, item, matches);
+            case ANY: return true;
+            case SOME:
+                for (uint i = inst.arg; i < inst.arg + inst.y; i++) {
+                    if (_test(item_literals[i], item, matches)) return true;
+                }
+                return false;
+            case EVERY:
+                for (uint i = inst.arg; i < inst.arg + inst.y; i++) {
+                    if (!_test(item_literals[i], item, matches)) return false;
                 }
+                return true;
+            default: return false;
+        }
+    }
+
+    /* Add a thread for everything an instruction leads to without consuming
+    anything, in the order of their priority, unless the list has one. */
+    void _add_thread(std::vector<Thread>& list,
+                     uint pc,
+                     int last_event,
+                     uint index) {
+        if (!closures.empty()) {
+            auto [first, last] = closures[pc];
+            for (auto i = first; i < last; i++) {
+                auto target = closure_pcs[i];
+                if (seen[target] == stamp) continue;
+                seen[target] = stamp;
+                list.push_back({target, last_event});
             }
-            return {0, false};
+            return;
         }
 
-        if (token->tag == INTERSECTION) {
-            if (i_items >= num_items) return {};
-            for (auto item : token->tokens) {
-                auto expected = std::get<A>(item);
-                auto actual = (*items)[i_items];
-                if (!(*matches)(expected, actual)) { return {0, false}; }
+        pending = {{pc, last_event}};
+        while (!pending.empty()) {
+            auto thread = pending.back();
+            pending.pop_back();
+            if (seen[thread.pc] == stamp) continue;
+            seen[thread.pc] = stamp;
+
+            auto& inst = insts[thread.pc];
+            switch (inst.op) {
+                case SPLIT:
+                    pending.push_back({inst.y, thread.events});
+                    pending.push_back({inst.arg, thread.events});
+                    break;
+                case JUMP:
+                    pending.push_back({inst.arg, thread.events});
+                    break;
+                case OPEN:
+                case CLOSE:
+                    events.push_back(
+                        {inst.arg, index, inst.op == CLOSE, thread.events});
+                    pending.push_back(
+                        {thread.pc + 1, (int)events.size() - 1});
+                    break;
+                default:
+                    list.push_back(thread);
             }
-            token->update_captures(&captures, items, old_index, old_index + 1);
-            return {1, true};
         }
+    }
 
-        if (token->tag == BETWEEN) {
-            Match<T> result;
-            uint max_items = std::min(
-                num_items,
-                token->max.is_inf ? UINT_MAX : i_items + token->max.num);
+    void _follow_all() {
+        std::vector<std::pair<uint, uint>> follows;
+        seen.assign(insts.size(), 0);
+        for (uint pc = 0; pc < insts.size(); pc++) {
+            stamp = pc + 1;
+            uint first = closure_pcs.size();
+            clist.clear();
+            _add_thread(clist, pc, NO_EVENT, 0);
+            for (auto thread : clist) closure_pcs.push_back(thread.pc);
+            follows.push_back({first, (uint)closure_pcs.size()});
+        }
+        closures = std::move(follows);
+    }
 
-            auto norm = token->normal();
+    /* Get the state for a set of threads, or -1 if there are too many. */
+    int _state(std::vector<uint> pcs) {
+        std::sort(pcs.begin(), pcs.end());
+        auto pos = state_ids.find(pcs);
+        if (pos != state_ids.end()) return pos->second;
+        if (states.size() == MAX_STATES) return -1;
+
+        State state;
+        for (auto pc : pcs) {
+            auto& inst = insts[pc];
+            if (inst.op == MATCH) state.accepts = true;
+            if (inst.op == ITEM) state.tests.push_back(inst.arg);
+            if (inst.op == SOME || inst.op == EVERY) {
+                for (uint i = inst.arg; i < inst.arg + inst.y; i++) {
+                    state.tests.push_back(item_literals[i]);
+                }
+            }
+        }
+        auto& tests = state.tests;
+        std::sort(tests.begin(), tests.end());
+        tests.erase(std::unique(tests.begin(), tests.end()), tests.end());
+        if (tests.size() > MAX_TESTS) return -1;
+
+        state.pcs = pcs;
+        state.next.assign(1 << tests.size(), -1);
+        states.push_back(state);
+        return state_ids[pcs] = states.size() - 1;
+    }
 
-            while (i_items < max_items) {
-                result = inner(&norm, i_items);
-                if (!result.is_good()) break;
-                i_items += result.value();
+    /* Get the state after an item, given which literals of the state it
+    matched, or -1 if it can't be made. */
+    int _transition(int from, uint mask) {
+        auto& pcs = states[from].pcs;
+        auto& tests = states[from].tests;
+        auto passes = [&](uint literal) {
+            auto bit = std::lower_bound(tests.begin(), tests.end(), literal);
+            return mask >> (bit - tests.begin()) & 1;
+        };
+
+        clist.clear();
+        stamp++;
+        for (auto pc : pcs) {
+            auto& inst = insts[pc];
+            bool consumed = inst.op == ANY || inst.op == EVERY;
+            if (inst.op == ITEM) consumed = passes(inst.arg);
+            for (uint i = inst.arg; i < inst.arg + inst.y; i++) {
+                if (inst.op == SOME) consumed |= passes(item_literals[i]);
+                if (inst.op == EVERY) consumed &= passes(item_literals[i]);
             }
+            if (consumed) _add_thread(clist, pc + 1, NO_EVENT, 0);
+        }
 
-            uint counter = i_items - old_index;
+        std::vector<uint> next;
+        for (auto thread : clist) next.push_back(thread.pc);
+        auto to = _state(next);
+        if (to >= 0) states[from].next[mask] = to;
+        return to;
+    }
 
-            bool exhausted = counter >= token->min.num_or(0) &&
-                             counter <= token->max.num_or_max();
+    /* Match a vector with the DFA, or give `Nothing` if it grew too large. */
+    template <typename T>
+    std::optional<bool> _dfa_match(std::vector<T>* items,
+                                   Comparer<A, T>* matches) {
+        if (states.empty()) {
+            clist.clear();
+            stamp++;
+            _add_thread(clist, 0, NO_EVENT, 0);
+            std::vector<uint> pcs;
+            for (auto thread : clist) pcs.push_back(thread.pc);
+            _state(pcs);
+        }
 
-            if (exhausted) {
-                token->update_captures(&captures, items, old_index, i_items);
+        int state = 0;
+        for (auto& item : *items) {
+            auto& tests = states[state].tests;
+            uint mask = 0;
+            for (uint i = 0; i < tests.size(); i++) {
+                if ((*matches)(literals[tests[i]], item)) mask |= 1 << i;
             }
-            return {counter, exhausted};
+
+            auto next = states[state].next[mask];
+            if (next < 0) next = _transition(state, mask);
+            if (next < 0) {
+                dfa_failed = true;
+                states.clear();
+                state_ids.clear();
+                return {};
+            }
+            state = next;
+            if (states[state].pcs.empty()) return false;
+        }
+        return states[state].accepts;
+    }
+
+    /* Collect the groups captured by a thread, in the order they closed. */
+    template <typename T>
+    CaptureMapper<T> _captures(int last_event, std::vector<T>* items) {
+        std::vector<Event> path;
+        for (auto i = last_event; i != NO_EVENT; i = events[i].previous) {
+            path.push_back(events[i]);
         }
 
-        // Catch fallthrough.
-        assert(false);
-        return {0, false};
-    };
+        CaptureMapper<T> captures = {};
+        std::vector<uint> starts(groupnames.size());
+        for (auto event = path.rbegin(); event != path.rend(); event++) {
+            if (!event->closes) {
+                starts[event->group] = event->index;
+                continue;
+            }
+            auto begin = items->begin();
+            captures[groupnames[event->group]].push_back(
+                {begin + starts[event->group], begin + event->index});
+        }
+        return captures;
+    }
+};
 
-    auto result = inner(token, 0);
-    if (result.is_good() && result.value() == items->size()) return captures;
-    return {};
+/* Match a vector expression token against a vector, returning its captures if
+it is successful, or `Nothing` otherwise. See `Program::fullmatch`, which
+should be used instead to match the same token more than once. */
+template <typename A, typename T>
+std::optional<CaptureMapper<T>> fullmatch(Token<A>* token,
+                                          std::vector<T>* items,
+                                          Comparer<A, T>* matches) {
+    return Program<A>(token).fullmatch(items, matches);
 }
 }  // namespace vecex
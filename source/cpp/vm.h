@@ -0,0 +1,491 @@
+/* A stack-based virtual machine which runs the bytecode from `bytecode.h`.
+
+Closures called from bytecode get a new frame in the same dispatch loop
+instead of recursing on the C++ stack. Builtins which call closures (`map`,
+`fold` etc.) still start a nested run, which shares the value stack.
+
+A tail call replaces the frame of the closure making it, keeping its scope and
+starting its region again once it has grown, so recursion in tail position runs
+in constant space. As scoping is dynamic, the callee sees the same variables it
+would have seen from a scope of its own, and the caller has no further use for
+them.
+*/
+#include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "./fuel.h"
+#include "./gc.h"
+#include "./bytecode.h"
+
+extern bool SAFE_MODE;
+
+LispVar call_builtin(LispVar operation, std::vector<LispVar *> args);
+LispVar update_builtin(LispVar operation,
+                       std::vector<LispVar *> args,
+                       unsigned int slot);
+LispVar evaluate_expression(LispVar *expression, unsigned int index);
+void _capture_locals(LispVar *closure);
+[[noreturn]] void _throw_cannot_bind(const std::string &name);
+
+// Maximum number of values on the stack. Pointers into the stack are handed
+// to builtins, so it is never allowed to reallocate.
+const unsigned int VM_STACK_SIZE = 1 << 18;
+
+/* The arguments and body of a closure. */
+struct CompiledClosure {
+    std::vector<unsigned int> parameters;  // Slots of the arguments.
+    unsigned int body_index;               // Node of the body in the tree.
+    Chunk *body = nullptr;                 // Compiled on the first VM call.
+};
+
+std::unordered_map<Tree<LispVar> *, CompiledClosure *> CLOSURE_CACHE;
+
+/* Get the parameters and body of a closure, finding them the first time.
+
+Both engines call closures through this, so the tree is only looked through
+once instead of copying the parameters and body on every call. */
+CompiledClosure *prepare_closure(LispVar closure) {
+    auto pos = CLOSURE_CACHE.find(closure.tree());
+    if (pos != CLOSURE_CACHE.end()) return pos->second;
+
+    // Closure example: {{n} (+ n 10)}
+    // The first branch is the arguments the function takes.
+    // The second is an expression to execute.
+    auto compiled = new CompiledClosure;
+    auto tree = closure.tree();
+
+    for (auto child : tree->children(1)) {
+        auto parameter = tree->nodes[child];
+        if (parameter.tag() == BUILTIN) {
+            _throw_cannot_bind(BUILTINS_NAMES[parameter.builtin()]);
+        }
+        compiled->parameters.push_back(parameter.slot());
+    }
+    compiled->body_index = compiled->parameters.size() + 2;
+
+    CLOSURE_CACHE[tree] = compiled;
+    return compiled;
+}
+
+/* Get the compiled form of a closure, compiling it the first time. */
+CompiledClosure *compile_closure(LispVar closure) {
+    auto compiled = prepare_closure(closure);
+    if (!compiled->body) {
+        compiled->body = compile_chunk(closure.tree(), compiled->body_index);
+    }
+    return compiled;
+}
+
+/* Start the region of a closure call again for a tail call made from it,
+keeping what can be reached from the callee or the variables bound in the
+call's scope, which the tail call shares. This is only done once the region
+has grown, since those values are traced every time. */
+void renew_call_region(LispVar callee) {
+    if (GC.region_allocations() < GC_RENEW_THRESHOLD) return;
+
+    static std::vector<LispVar> live;
+    live.assign(1, callee);
+    for (auto slot : VARIABLE_SCOPE.local_slots()) {
+        live.push_back(VARIABLE_SCOPE.peek_var(slot));
+    }
+    GC.renew_region(live);
+}
+
+/* Mark the constants of the code compiled from a tree. */
+void _mark_compiled(Tree<LispVar> *tree) {
+    auto pos = CHUNK_CACHE.lower_bound({tree, 0});
+    for (; pos != CHUNK_CACHE.end() && pos->first.first == tree; pos++) {
+        for (auto constant : pos->second->constants) GC.mark(constant);
+    }
+
+    auto capture = CAPTURE_CACHE.lower_bound({tree, 0});
+    for (; capture != CAPTURE_CACHE.end() && capture->first.first == tree;
+         capture++) {
+        GC.mark(capture->second);
+    }
+}
+
+/* Queue the expressions captured from a tree to be traced. */
+void _push_captures(Tree<LispVar> *tree, std::vector<LispVar> &pending) {
+    auto pos = CAPTURE_CACHE.lower_bound({tree, 0});
+    for (; pos != CAPTURE_CACHE.end() && pos->first.first == tree; pos++) {
+        pending.push_back(pos->second);
+    }
+}
+
+/* Drop the code compiled from a tree which is being freed. */
+void _forget_compiled(Tree<LispVar> *tree) {
+    auto closure = CLOSURE_CACHE.find(tree);
+    if (closure != CLOSURE_CACHE.end()) {
+        delete closure->second;
+        CLOSURE_CACHE.erase(closure);
+    }
+
+    auto pos = CHUNK_CACHE.lower_bound({tree, 0});
+    while (pos != CHUNK_CACHE.end() && pos->first.first == tree) {
+        delete pos->second;
+        pos = CHUNK_CACHE.erase(pos);
+    }
+
+    auto capture = CAPTURE_CACHE.lower_bound({tree, 0});
+    while (capture != CAPTURE_CACHE.end() && capture->first.first == tree) {
+        capture = CAPTURE_CACHE.erase(capture);
+    }
+}
+
+struct Frame {
+    Chunk *chunk;
+    unsigned int pc;
+    unsigned int base;  // Stack height to restore when returning.
+    bool is_closure;    // Whether or not returning leaves a closure scope.
+};
+
+/* A loop body which can be broken out of. */
+struct LoopHandler {
+    unsigned int frame;
+    unsigned int pc;
+    unsigned int height;
+};
+
+class LispVirtualMachine {
+   public:
+    std::vector<LispVar> stack;
+    std::vector<Frame> frames;
+    std::vector<LoopHandler> loops;
+
+    LispVirtualMachine() { stack.reserve(VM_STACK_SIZE); }
+
+    /* Evaluate a node of an expression. */
+    LispVar evaluate(LispVar *expression, unsigned int index) {
+        auto chunk = compile_chunk(expression->tree(), index);
+        unsigned int entry = frames.size();
+        _push_frame(chunk, stack.size(), false);
+        return run(entry);
+    }
+
+    /* Call a closure on the inputs. */
+    LispVar call_closure(LispVar closure, std::vector<LispVar *> arguments) {
+        assert(closure.tag() == CLOSURE);
+        auto compiled = compile_closure(closure);
+        auto arity = compiled->parameters.size();
+        assert(arity == arguments.size());
+
+        VARIABLE_SCOPE.increment();
+        assert(VARIABLE_SCOPE.depth < 2048);
+        for (size_t i = 0; i < arity; i++) {
+            VARIABLE_SCOPE.set_var(compiled->parameters[i], *arguments[i]);
+        }
+
+        unsigned int entry = frames.size();
+        _push_frame(compiled->body, stack.size(), true);
+        return run(entry);
+    }
+
+    /* Run until the frame at index `entry` returns.
+
+    Breaks and early returns thrown by builtins are handled here when they
+    target a loop or closure of this run, and passed on otherwise. */
+    LispVar run(unsigned int entry) {
+        while (true) {
+            try {
+                return _dispatch(entry);
+            } catch (LispBreak &exception) {
+                _break(entry);
+            } catch (LispEarlyReturn &exception) {
+                _early_return(entry, exception.value);
+            }
+        }
+    }
+
+    /* Free the values which can no longer be reached.
+
+    This is only done at safe points in the dispatch loop or the tree walker,
+    where every live value is bound to a variable, on the stack, in the
+    constants of a running chunk, part of a builtin signature or protected by
+    a `GCRoot`. */
+    void collect_garbage() {
+        for (auto type : BUILTINS_TYPES) {
+            if (type) GC.mark(*type);
+        }
+        for (auto &values : VARIABLE_SCOPE.scopes) {
+            for (auto &item : values) GC.mark(item.value);
+        }
+        for (auto &value : stack) GC.mark(value);
+        for (auto &frame : frames) GC.mark(frame.chunk->source);
+        GC.mark_roots();
+        GC.sweep();
+    }
+
+   private:
+    /* Make sure a chunk can be run on top of the stack. */
+    void _check_stack(Chunk *chunk) {
+        if (stack.size() + chunk->max_stack >= VM_STACK_SIZE) {
+            std::cout << "[StackOverflowError] The virtual machine ran out "
+                         "of stack space.\n";
+            exit(1);
+        }
+    }
+
+    void _push_frame(Chunk *chunk, unsigned int base, bool is_closure) {
+        _check_stack(chunk);
+        frames.push_back({chunk, 0, base, is_closure});
+        if (is_closure) GC.open_region();
+    }
+
+    /* Pop the innermost frame without returning from it. */
+    void _drop_frame() {
+        if (frames.back().is_closure) {
+            VARIABLE_SCOPE.decrement();
+            GC.merge_region();
+        }
+        frames.pop_back();
+    }
+
+    /* Pop the frames of this run before passing an exception on. */
+    void _leave_run(unsigned int entry) {
+        stack.resize(frames[entry].base);
+        while (frames.size() > entry) _drop_frame();
+        while (!loops.empty() && loops.back().frame >= entry) loops.pop_back();
+    }
+
+    /* Continue after the innermost loop body of this run. */
+    void _break(unsigned int entry) {
+        if (loops.empty() || loops.back().frame < entry) {
+            _leave_run(entry);
+            throw LispBreak();
+        }
+
+        auto handler = loops.back();
+        while (frames.size() > handler.frame + 1) _drop_frame();
+        stack.resize(handler.height);
+        frames.back().pc = handler.pc;
+    }
+
+    /* Return a value from the innermost closure of this run. */
+    void _early_return(unsigned int entry, LispVar value) {
+        // Only the first frame of a run may belong to something else than a
+        // closure.
+        if (!frames.back().is_closure) {
+            _leave_run(entry);
+            LispEarlyReturn early_return;
+            early_return.value = value;
+            throw early_return;
+        }
+
+        auto frame = &frames.back();
+        unsigned int index = frames.size() - 1;
+        while (!loops.empty() && loops.back().frame >= index) loops.pop_back();
+
+        // Jump to the final RETURN of the chunk with the value on top.
+        stack.resize(frame->base);
+        stack.push_back(value);
+        frame->pc = frame->chunk->code.size() - 1;
+    }
+
+    /* Replace the innermost frame, which belongs to a closure, with a call to
+    another closure whose arguments are on top of the stack, above `slot`. */
+    void _tail_call(CompiledClosure *compiled, unsigned int slot) {
+        auto frame = &frames.back();
+        unsigned int index = frames.size() - 1;
+        while (!loops.empty() && loops.back().frame >= index) loops.pop_back();
+
+        for (size_t i = 0; i < compiled->parameters.size(); i++) {
+            VARIABLE_SCOPE.set_var(compiled->parameters[i],
+                                   stack[slot + 1 + i]);
+        }
+        renew_call_region(stack[slot]);
+        stack.resize(frame->base);
+        _check_stack(compiled->body);
+        frame->chunk = compiled->body;
+        frame->pc = 0;
+    }
+
+    /* Get pointers to the top `arity` items of the stack. */
+    std::vector<LispVar *> _top(unsigned int arity) {
+        std::vector<LispVar *> arguments(arity);
+        auto first = stack.size() - arity;
+        for (size_t i = 0; i < arity; i++) arguments[i] = &stack[first + i];
+        return arguments;
+    }
+
+    /* Call a builtin on the top `arity` items of the stack. */
+    LispVar _call_builtin(LispVar builtin, unsigned int arity) {
+        auto result = call_builtin(builtin, _top(arity));
+        if (PENDING_SIGNAL) raise_signal();
+        return result;
+    }
+
+    LispVar _dispatch(unsigned int entry) {
+        auto frame = &frames.back();
+
+        while (true) {
+            FUEL.burn();
+            auto ins = frame->chunk->code[frame->pc++];
+
+            switch (ins.op) {
+                case OP_PUSH_CONST:
+                    stack.push_back(frame->chunk->constants[ins.a]);
+                    break;
+
+                case OP_LOAD_VAR: {
+                    auto value = VARIABLE_SCOPE.get_var(ins.a);
+
+                    // These builtins take their arguments unevaluated, so
+                    // leave calling them through variables to the tree
+                    // walker.
+                    if (value.tag() == BUILTIN &&
+                        (value.builtin() == B_LET ||
+                         value.builtin() == B_EXPRESSION)) {
+                        auto node = frame->chunk->nodes[frame->pc - 1];
+                        value = evaluate_expression(&frame->chunk->source, node);
+                        if (PENDING_SIGNAL) raise_signal();
+                        frame = &frames.back();
+                        frame->pc = ins.b;
+                    }
+                    stack.push_back(value);
+                    break;
+                }
+
+                case OP_STORE_VAR:
+                    VARIABLE_SCOPE.set_var(ins.a, stack.back());
+                    break;
+
+                case OP_TAKE_VAR:
+                    stack.push_back(VARIABLE_SCOPE.take_var(ins.a));
+                    break;
+
+                case OP_UPDATE_VAR: {
+                    auto chunk = frame->chunk;
+                    auto builtin =
+                        chunk->source.tree()->nodes[chunk->nodes[frame->pc - 1]];
+                    unsigned int arity = ins.b & ~RESULT_UNUSED;
+
+                    auto result = update_builtin(builtin, _top(arity), ins.a);
+                    stack.resize(stack.size() - arity);
+                    stack.push_back(result);
+                    VARIABLE_SCOPE.set_var(ins.a, result, ins.b & RESULT_UNUSED);
+                    frame = &frames.back();
+                    break;
+                }
+
+                case OP_POP:
+                    stack.pop_back();
+                    break;
+
+                case OP_CHECK_CALLEE:
+                    if (!stack.back().is_callable()) frame->pc = ins.a;
+                    break;
+
+                case OP_CALL:
+                case OP_TAIL_CALL: {
+                    unsigned int slot = stack.size() - ins.a - 1;
+                    auto callee = stack[slot];
+
+                    if (callee.tag() == CLOSURE) {
+                        if (GC.should_collect()) collect_garbage();
+
+                        auto compiled = compile_closure(callee);
+                        auto arity = compiled->parameters.size();
+                        assert(arity == ins.a);
+
+                        if (ins.op == OP_TAIL_CALL && frame->is_closure) {
+                            _tail_call(compiled, slot);
+                            break;
+                        }
+
+                        VARIABLE_SCOPE.increment();
+                        assert(VARIABLE_SCOPE.depth < 2048);
+                        for (size_t i = 0; i < arity; i++) {
+                            VARIABLE_SCOPE.set_var(compiled->parameters[i],
+                                                   stack[slot + 1 + i]);
+                        }
+                        _push_frame(compiled->body, slot, true);
+                        frame = &frames.back();
+                        break;
+                    }
+
+                    auto result = _call_builtin(callee, ins.a);
+                    stack.resize(slot);
+                    stack.push_back(result);
+                    frame = &frames.back();
+                    break;
+                }
+
+                case OP_CALL_BUILTIN: {
+                    auto result =
+                        _call_builtin(frame->chunk->constants[ins.a], ins.b);
+                    stack.resize(stack.size() - ins.b);
+                    stack.push_back(result);
+                    frame = &frames.back();
+                    break;
+                }
+
+                case OP_JUMP:
+                    frame->pc = ins.a;
+                    break;
+
+                case OP_JUMP_IF_FALSE: {
+                    auto condition = stack.back();
+                    stack.pop_back();
+
+                    // Report badly typed conditions the same way `?` does.
+                    if (ins.b && SAFE_MODE && BUILTINS_TYPES_READY &&
+                        !condition.is_booly()) {
+                        LispVar ternary = {BUILTIN, B_TERNARY};
+                        call_builtin(ternary,
+                                     {&condition, _SINGLETON_NIL, _SINGLETON_NIL});
+                    }
+                    if (!condition.truthiness()) frame->pc = ins.a;
+                    break;
+                }
+
+                case OP_LOOP_ENTER:
+                    loops.push_back({(unsigned int)frames.size() - 1,
+                                     ins.a,
+                                     (unsigned int)stack.size()});
+                    break;
+
+                case OP_LOOP_EXIT:
+                    loops.pop_back();
+                    break;
+
+                case OP_LOOP_NEXT:
+                    if (GC.should_collect()) collect_garbage();
+                    break;
+
+                case OP_BREAK:
+                    _break(entry);
+                    frame = &frames.back();
+                    break;
+
+                case OP_EARLY_RETURN:
+                    _early_return(entry, stack.back());
+                    frame = &frames.back();
+                    break;
+
+                case OP_RETURN: {
+                    auto result = stack.back();
+                    auto done = frames.back();
+                    frames.pop_back();
+                    stack.resize(done.base);
+
+                    if (done.is_closure) {
+                        _capture_locals(&result);
+                        VARIABLE_SCOPE.decrement();
+                        GC.close_region(result);
+                    }
+                    if (frames.size() == entry) return result;
+
+                    stack.push_back(result);
+                    frame = &frames.back();
+                    break;
+                }
+            }
+        }
+    }
+};
+
+LispVirtualMachine VIRTUAL_MACHINE;
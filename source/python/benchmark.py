@@ -0,0 +1,199 @@
+#!/usr/bin/env python3.10
+"""Time the programs in the benchmarks directory."""
+import argparse
+import logging
+import pathlib as p
+import statistics
+import subprocess
+import time
+import typing as t
+
+import preprocess
+import utils
+
+BASEPATH = p.Path(__file__).parent
+BENCHMARK_DIR = BASEPATH.parent.parent / "benchmarks"
+EXECUTABLE_PATH = BASEPATH.parent / "lisp"
+
+# The arguments to run each benchmark with.
+BENCHMARKS: t.Dict[str, t.List[t.List[str]]] = {
+    "scope_exit": [
+        ["0", "0"],
+        ["0", "50000"],
+        ["20000", "0"],
+        ["20000", "50000"],
+        ["80000", "0"],
+        ["80000", "50000"],
+    ],
+    "sort": [["100"], ["400"]],
+    "native_sort": [["400"], ["100000"]],
+    "append": [["5000"], ["20000"]],
+    "accumulate": [["20000"], ["90000"]],
+    "convolve": [["3", "20000"], ["15", "20000"]],
+    "early_exit": [["0", "20000"], ["1", "20000"], ["2", "20000"]],
+    "regex": [["20000"], ["100000"]],
+}
+
+# Megabytes of canonical code to time parsing on.
+PARSE_SIZES = [1, 8]
+
+
+def canonize(path: p.Path) -> p.Path:
+    """Preprocess a benchmark once, returning the path to the canonical code."""
+    processor = preprocess.Preprocessor()
+    processor.contexts[-1] = path
+    canon = processor.make_canon(utils.cat(path))
+
+    temp_path = utils.temp_path().with_suffix(".lisp")
+    with open(temp_path, "w", encoding="utf-8") as file:
+        file.write(canon)
+    return temp_path
+
+
+def time_run(command: t.List[str], repeat: int) -> t.List[float]:
+    """Get the wall time of each of a number of runs of a command."""
+    times = []
+
+    for _ in range(repeat):
+        start = time.perf_counter()
+        result = subprocess.run(command, stdout=subprocess.DEVNULL)
+        times.append(time.perf_counter() - start)
+
+        if result.returncode:
+            logging.error(f"Command {command!r} exited with {result.returncode}.")
+            exit(result.returncode)
+
+    return times
+
+
+def time_parse(command: t.List[str], repeat: int) -> None:
+    """Time parsing large files made by repeating the canonical code of the
+    benchmarks, reporting how fast it is parsed.
+
+    The code is put in a single expression so that it is parsed but not run,
+    and the time it takes to run a file with nothing in it is taken off."""
+    canon = ""
+    for path in sorted(BENCHMARK_DIR.glob("*.lisp")):
+        canon_path = canonize(path)
+        canon += utils.cat(canon_path) + "\n"
+        canon_path.unlink()
+
+    def run(code: str) -> float:
+        temp_path = utils.temp_path().with_suffix(".lisp")
+        with open(temp_path, "w", encoding="utf-8") as file:
+            file.write(code)
+        times = time_run([command[0], str(temp_path), *command[1:]], repeat)
+        temp_path.unlink()
+        return min(times)
+
+    startup = run("Nil\n")
+    for size in PARSE_SIZES:
+        copies = size * 2**20 // len(canon.encode("utf-8")) + 1
+        code = "{\n" + canon * copies + "}\n"
+        megabytes = len(code.encode("utf-8")) / 2**20
+        parse_time = run(code) - startup
+        label = f"parse {megabytes:.1f}MB"
+        print(f"{label:<40} min {parse_time:8.4f}s  {megabytes / parse_time:8.1f}MB/s")
+
+
+def compare_regex() -> None:
+    """Time the searches of the regex benchmark with the engine of the builtins
+    and with `std::regex`, on each of the log sizes the benchmark is run with."""
+    temp_path = utils.temp_path()
+    source_path = BENCHMARK_DIR / "regex_compare.cpp"
+    subprocess.run(["g++", "-O1", "-o", str(temp_path), str(source_path)], check=True)
+
+    for arguments in BENCHMARKS["regex"]:
+        print(f"regex_compare {' '.join(arguments)}", flush=True)
+        subprocess.run([str(temp_path), *arguments], check=True)
+
+    temp_path.unlink()
+
+
+def main() -> None:
+    """Time the programs in the benchmarks directory."""
+    parser = argparse.ArgumentParser(description="Time the Lisp benchmarks.")
+    parser.add_argument(
+        "names",
+        metavar="N",
+        nargs="*",
+        help=(
+            "the benchmarks to run, `parse` to time the parser or `regex_compare` to"
+            " compare regular expressions with std::regex (defaults to all)"
+        ),
+    )
+    parser.add_argument(
+        "--repeat",
+        type=int,
+        default=5,
+        help="number of times to run each benchmark",
+    )
+    parser.add_argument(
+        "--engine",
+        choices=["vm", "tree"],
+        default="vm",
+        help="evaluate with the bytecode virtual machine or the tree walker",
+    )
+    parser.add_argument(
+        "--unsafe",
+        action="store_const",
+        const=True,
+        default=False,
+        help="run unsafely",
+    )
+
+    args = parser.parse_args()
+    names = args.names or [*BENCHMARKS, "parse"]
+
+    if not EXECUTABLE_PATH.exists():
+        logging.error("Could not find the executable. Run `./build.sh` first.")
+        exit(1)
+
+    for name in names:
+        if name == "parse":
+            time_parse(
+                [
+                    str(EXECUTABLE_PATH),
+                    str(0),
+                    str(int(not args.unsafe)),
+                    str(int(args.engine == "vm")),
+                    str(0),
+                    str(0),
+                    str(0),
+                    str(0),
+                ],
+                args.repeat,
+            )
+            continue
+
+        if name == "regex_compare":
+            compare_regex()
+            continue
+
+        canon_path = canonize(BENCHMARK_DIR / f"{name}.lisp")
+
+        for arguments in BENCHMARKS[name]:
+            command = [
+                str(EXECUTABLE_PATH),
+                str(canon_path),
+                str(0),
+                str(int(not args.unsafe)),
+                str(int(args.engine == "vm")),
+                str(0),
+                str(0),
+                str(0),
+                str(0),
+                *arguments,
+            ]
+            times = time_run(command, args.repeat)
+            label = " ".join([name, *arguments])
+            print(
+                f"{label:<40} min {min(times):8.4f}s"
+                f"  median {statistics.median(times):8.4f}s"
+            )
+
+        canon_path.unlink()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3.10
+"""Caches canons, so that code which hasn't changed isn't preprocessed again.
+
+An entry is keyed by the hash of the code, the directory it's included from and the
+version of the preprocessor, which is the hash of its code and data. It remembers the
+hashes of the files the code included, and is only used if none of them has changed.
+"""
+import hashlib
+import json
+import os
+import pathlib as p
+import typing as t
+
+BASEPATH = p.Path(__file__).parent
+CACHE_PATH = p.Path("/tmp/lisp/cache")
+STATS_PATH = CACHE_PATH / "stats.json"
+VERSION_FILES = [
+    *(BASEPATH / "preprocess").glob("*.py"),
+    BASEPATH / "utils.py",
+    *(BASEPATH.parent / "data").glob("*.cson"),
+]
+
+
+def _hash_bytes(*chunks: bytes) -> str:
+    digest = hashlib.md5()
+    for chunk in chunks:
+        digest.update(hashlib.md5(chunk).digest())
+    return digest.hexdigest()
+
+
+def _hash_file(path: p.Path) -> t.Optional[str]:
+    try:
+        return _hash_bytes(path.read_bytes())
+    except OSError:
+        return None
+
+
+def _write_atomically(path: p.Path, text: str):
+    """Write a file so that concurrent runs never read it half written."""
+    temp_path = path.with_name(f"{path.name}.{os.getpid()}.tmp")
+    temp_path.write_text(text, encoding="utf-8")
+    os.replace(temp_path, path)
+
+
+def canon_path(canon: str) -> p.Path:
+    """Get the path the executable reads a canon from."""
+    digest = hashlib.md5(canon.encode("utf-8")).hexdigest()
+    return p.Path("/tmp/lisp") / (digest + ".lisp")
+
+
+def key_of(code: str, origin: t.Optional[p.Path]) -> str:
+    """Get the key of the entry for some code, read from `origin` if it's a file."""
+    version = [path.read_bytes() for path in sorted(VERSION_FILES)]
+    context = str(origin.resolve().parent) if origin is not None else ""
+    return _hash_bytes(*version, context.encode("utf-8"), code.encode("utf-8"))
+
+
+def load(key: str) -> t.Optional[p.Path]:
+    """Get the path of the cached canon, or None if it's missing or stale."""
+    try:
+        entry = json.loads((CACHE_PATH / (key + ".json")).read_text(encoding="utf-8"))
+    except (OSError, ValueError):
+        return None
+
+    for dependency, digest in entry["dependencies"].items():
+        if _hash_file(p.Path(dependency)) != digest:
+            return None
+
+    path = p.Path(entry["canon"])
+    return path if path.exists() else None
+
+
+def store(key: str, canon: str, dependencies: t.Iterable[p.Path]) -> p.Path:
+    """Write a canon, remembering the files it was made from, and return its path."""
+    path = canon_path(canon)
+    CACHE_PATH.mkdir(parents=True, exist_ok=True)
+    _write_atomically(path, canon)
+
+    entry = {
+        "canon": str(path),
+        "dependencies": {
+            str(dependency.resolve()): _hash_file(dependency)
+            for dependency in dependencies
+        },
+    }
+    _write_atomically(CACHE_PATH / (key + ".json"), json.dumps(entry))
+    return path
+
+
+def count(hit: bool) -> t.Dict[str, int]:
+    """Count a lookup in the running totals, and return the totals."""
+    try:
+        stats = json.loads(STATS_PATH.read_text(encoding="utf-8"))
+    except (OSError, ValueError):
+        stats = {"hits": 0, "misses": 0}
+
+    stats["hits" if hit else "misses"] += 1
+    CACHE_PATH.mkdir(parents=True, exist_ok=True)
+    _write_atomically(STATS_PATH, json.dumps(stats))
+    return stats
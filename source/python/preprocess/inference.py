@@ -0,0 +1,444 @@
+"""Infers the types of canonical Lisp code.
+
+This is used to find the builtin calls whose type checks can't fail, which
+then get their name prefixed with `$` so that `call_builtin` doesn't check them
+at runtime. Scoping is dynamic, so the type of a variable is the union of
+everything it is bound to anywhere in the program. The parameters of closures
+which are only ever called directly by name get the types of the arguments at
+their call sites, while all other parameters can be anything.
+"""
+import dataclasses as dc
+import pathlib as p
+import typing as t
+
+import regex as re
+import utils
+
+BASEPATH = p.Path(__file__).parent.parent
+BUILTINS = utils.cson_from_path(BASEPATH.parent / "data" / "builtins.cson")
+
+PROVEN_PREFIX = "$"
+
+Types = t.FrozenSet[str]
+
+# The types a value can have at runtime.
+ANY: Types = frozenset(
+    {
+        "int",
+        "float",
+        "string",
+        "list",
+        "vector",
+        "nil",
+        "bool",
+        "builtin",
+        "type",
+        "expression",
+        "closure",
+    }
+)
+NOTHING: Types = frozenset()
+
+_SIZED = frozenset({"string", "vector", "list", "expression", "closure"})
+
+# These have to be kept the same as `_type_mask` in lisp.cpp.
+TYPE_CLASSES: t.Dict[str, Types] = {
+    "any": ANY,
+    "truthy": ANY,
+    "falsy": ANY,
+    "callable": frozenset({"builtin", "closure"}),
+    "booly": frozenset({"int", "nil", "bool"}) | _SIZED,
+    "iterable": _SIZED,
+    "indexable": frozenset({"list", "vector"}),
+    "pattern": frozenset({"string", "regex"}),
+    "numeric": frozenset({"int", "bool", "float"}),
+    "num": frozenset({"int"}),
+}
+
+# Builtins which never give a value back to their caller.
+_DIVERGING = {"return", "break", "exit"}
+_ARITHMETIC = {"add", "sub", "mul", "div"}
+
+Node = t.Union[str, t.List["Node"]]
+
+
+def _types_of(name: str) -> Types:
+    return TYPE_CLASSES.get(name, frozenset({name}))
+
+
+@dc.dataclass
+class Pattern:
+    """One argument of a builtin signature."""
+
+    types: Types = ANY
+    checks_value: bool = False
+    min: int = 1
+    max: float = 1
+
+    def accepts(self, types: Types) -> t.Optional[bool]:
+        """Whether or not every value of the types is accepted, or `None` if
+        it depends on the value."""
+        if not types:
+            return True
+        if self.checks_value:
+            return None
+        if types <= self.types:
+            return True
+        if not types & self.types:
+            return False
+        return None
+
+
+def _parse_signature(signature: str) -> t.List[Pattern]:
+    patterns = []
+    for group in re.findall(r"\(map type \[([^]]*)\]\)", signature):
+        pattern = Pattern()
+        for name in re.findall(r'\\?"([^"\\]*)\\?"', group):
+            if name == "*":
+                pattern.min, pattern.max = 0, float("inf")
+            elif name == "+":
+                pattern.min, pattern.max = 1, float("inf")
+            elif name == "?":
+                pattern.min, pattern.max = 0, 1
+            else:
+                pattern.types &= _types_of(name)
+                pattern.checks_value |= name in ("truthy", "falsy")
+        patterns.append(pattern)
+    return patterns
+
+
+SIGNATURES = {name: _parse_signature(value[0]) for name, value in BUILTINS.items()}
+RETURNS = {name: _types_of(value[1]) for name, value in BUILTINS.items()}
+
+
+def signature_matches(patterns: t.List[Pattern], args: t.List[Types]) -> bool:
+    """Whether or not the arguments always match a signature, the same way
+    `TypeSignature::matches` matches them at runtime."""
+    i = 0
+    for pattern in patterns:
+        count = 0
+        while i < len(args) and count < pattern.max:
+            accepted = pattern.accepts(args[i])
+            if accepted is None:
+                return False
+            if not accepted:
+                break
+            i += 1
+            count += 1
+        if count < pattern.min:
+            return False
+    return i == len(args)
+
+
+def parse(canon: str) -> Node:
+    """Parse canonical code into nested lists of tokens."""
+    stack: t.List[t.List[Node]] = [[]]
+    token = ""
+    in_string_literal = False
+    escape_next = False
+
+    for char in canon:
+        if in_string_literal:
+            token += char
+            in_string_literal = escape_next or char != '"'
+            escape_next = not escape_next and char == "\\"
+            continue
+
+        # Anything else would be read differently by the interpreter.
+        assert char not in "[]{};"
+
+        if char in "()" or char.isspace():
+            if token:
+                stack[-1].append(token)
+                token = ""
+            if char == "(":
+                stack.append([])
+            elif char == ")":
+                node = stack.pop()
+                stack[-1].append(node)
+            continue
+
+        in_string_literal = char == '"'
+        token += char
+
+    if token:
+        stack[-1].append(token)
+    assert len(stack) == 1 and len(stack[0]) == 1
+    return stack[0][0]
+
+
+def unparse(node: Node) -> str:
+    """Turn parsed code back into canonical code."""
+    if isinstance(node, str):
+        return node
+    return "(" + " ".join(map(unparse, node)) + ")"
+
+
+def _literal_types(token: str) -> t.Optional[Types]:
+    """Get the types of a token which is not a variable, or `None` if it is
+    one. This follows `evaluate_const`."""
+    if token in BUILTINS:
+        return frozenset({"builtin"})
+    if token in ("Yes", "No"):
+        return frozenset({"bool"})
+    if token == "Nil":
+        return frozenset({"nil"})
+    if len(token) >= 2 and token[0] == token[-1] == '"':
+        return frozenset({"string"})
+
+    # Tokens are read as numbers if they start like one.
+    if "." in token:
+        if re.match(r"[+-]?(\d|\.\d|inf|nan)", token, re.IGNORECASE):
+            return frozenset({"float"})
+    elif re.match(r"[+-]?\d", token):
+        return frozenset({"int"})
+    return None
+
+
+def _is_variable(node: Node) -> bool:
+    return isinstance(node, str) and _literal_types(node) is None
+
+
+def _is_call(node: Node, name: str) -> bool:
+    return isinstance(node, list) and bool(node) and node[0] == name
+
+
+def _arguments(node: t.List[Node]) -> t.List[Node]:
+    # Calls without arguments, like `(input)`, are not given any.
+    return node[1:]
+
+
+@dc.dataclass
+class Closure:
+    """A closure literal, `(closure (expression (vector ...) body))`."""
+
+    parameters: t.List[str]
+    body: Node
+    returned: t.List[Node] = dc.field(default_factory=list)
+
+
+@dc.dataclass
+class Program:
+    """The bindings of a program, used to infer the types in it."""
+
+    root: Node
+    lets: t.Dict[str, t.List[Node]] = dc.field(default_factory=dict)
+    closures: t.Dict[str, t.List[Closure]] = dc.field(default_factory=dict)
+    untracked: t.List[Closure] = dc.field(default_factory=list)
+    calls: t.Dict[str, t.List[t.List[Node]]] = dc.field(default_factory=dict)
+    escaping: t.Set[str] = dc.field(default_factory=set)
+    tracked: t.Set[str] = dc.field(default_factory=set)  # All calls known.
+    is_dynamic: bool = False  # Whether or not names are bound at runtime.
+
+    variables: t.Dict[str, Types] = dc.field(default_factory=dict)
+    results: t.Dict[str, Types] = dc.field(default_factory=dict)
+    _types: t.Dict[int, Types] = dc.field(default_factory=dict)
+
+    def collect(
+        self, node: Node, closure: t.Optional[Closure] = None, used: bool = True
+    ) -> None:
+        """Find the bindings, closures and calls in a node, where `used` is
+        whether or not its value can be used by anything."""
+        if isinstance(node, str):
+            if node in ("let", "closure"):
+                self.is_dynamic = True
+            elif _is_variable(node):
+                self.escaping.add(node)
+            return
+
+        head, args = node[0], _arguments(node)
+
+        if head == "let":
+            if len(args) != 2 or not _is_variable(args[0]):
+                self.is_dynamic = True
+                return
+            self.lets.setdefault(args[0], []).append(args[1])
+            literal = self._closure_literal(args[1])
+            if literal:
+                # `let` gives back the closure, which could be called later.
+                if used:
+                    self.escaping.add(args[0])
+                self.closures.setdefault(args[0], []).append(literal)
+                self.collect(literal.body, literal)
+                return
+            self.collect(args[1], closure)
+            return
+
+        if head == "closure":
+            literal = self._closure_literal(node)
+            if not literal:
+                self.is_dynamic = True
+                return
+            self.untracked.append(literal)
+            self.collect(literal.body, literal)
+            return
+
+        if head == "return" and closure and args:
+            closure.returned.append(args[0])
+
+        if isinstance(head, str) and _is_variable(head):
+            self.calls.setdefault(head, []).append(args)
+        else:
+            self.collect(head, closure)
+
+        for i, arg in enumerate(args):
+            # Only the last value of a `do` is given back.
+            is_used = head != "do" or i == len(args) - 1
+            self.collect(arg, closure, is_used)
+
+    @staticmethod
+    def _closure_literal(node: Node) -> t.Optional[Closure]:
+        if not _is_call(node, "closure") or len(node) != 2:
+            return None
+        expression = node[1]
+        if not _is_call(expression, "expression") or len(expression) != 3:
+            return None
+        parameters = expression[1]
+        if not isinstance(parameters, list) or not all(
+            map(_is_variable, parameters[1:])
+        ):
+            return None
+        return Closure(parameters[1:], expression[2])
+
+    def infer(self) -> bool:
+        """Find the types of the variables and closure results, returning
+        whether or not they could be found."""
+        parameters = {
+            name
+            for closures in [*self.closures.values(), self.untracked]
+            for closure in closures
+            for name in closure.parameters
+        }
+
+        for name, closures in self.closures.items():
+            # Closures can only be followed if their name is only ever called.
+            is_tracked = name not in self.escaping and name not in parameters
+            is_tracked &= len(self.lets[name]) == len(closures)
+            if is_tracked:
+                self.tracked.add(name)
+            else:
+                self.untracked.extend(closures)
+
+        # The types only grow, so this stops once nothing changes.
+        for _ in range(64):
+            variables = {name: NOTHING for name in [*self.lets, *parameters]}
+            variables["argv"] = frozenset({"vector"})  # Set by the interpreter.
+            results = {}
+            self._types = {}
+
+            for name, values in self.lets.items():
+                for value in values:
+                    variables[name] |= self.type_of(value)
+
+            for name, closures in self.closures.items():
+                if name not in self.tracked:
+                    continue
+
+                result = NOTHING
+                for closure in closures:
+                    for args in self.calls.get(name, []):
+                        for parameter, arg in zip(closure.parameters, args):
+                            variables[parameter] |= self.type_of(arg)
+                    result |= self.type_of(closure.body)
+                    for value in closure.returned:
+                        result |= self.type_of(value)
+                results[name] = result
+
+            for closure in self.untracked:
+                for name in closure.parameters:
+                    variables[name] = ANY
+
+            if variables == self.variables and results == self.results:
+                self._types = {}
+                return True
+            self.variables, self.results = variables, results
+
+        return False
+
+    def type_of(self, node: Node) -> Types:
+        """Get the types a node can evaluate to."""
+        if id(node) not in self._types:
+            self._types[id(node)] = self._type_of(node)
+        return self._types[id(node)]
+
+    def _type_of(self, node: Node) -> Types:
+        if isinstance(node, str):
+            literal = _literal_types(node)
+            if literal is not None:
+                return literal
+            return self.variables.get(node, NOTHING)
+
+        head, args = node[0], _arguments(node)
+
+        if not isinstance(head, str):
+            return ANY
+        if _is_variable(head):
+            if head in self.tracked:
+                return self.results.get(head, NOTHING)
+            return ANY
+        if head not in BUILTINS:
+            # Calling something which is not callable gives it back.
+            return self.type_of(head)
+        return self._result_of(head, args)
+
+    def _result_of(self, builtin: str, args: t.List[Node]) -> Types:
+        types = [self.type_of(arg) for arg in args]
+
+        if builtin in _DIVERGING:
+            return NOTHING
+        if builtin in ("do", "let", "copy"):
+            return types[-1] if types else frozenset({"nil"})
+        if builtin == "ternary" and len(types) == 3:
+            return types[1] | types[2]
+        if builtin == "eval_expr" and len(args) == 1:
+            return self._evaluated(args[0])
+        if builtin == "neg" and types and types[0] <= TYPE_CLASSES["numeric"]:
+            return types[0]
+        if builtin in _ARITHMETIC:
+            if not any("float" in arg for arg in types):
+                return frozenset({"int"})
+            if any(arg == {"float"} for arg in types):
+                return frozenset({"float"})
+            return frozenset({"int", "float"})
+        return RETURNS[builtin]
+
+    def _evaluated(self, node: Node) -> Types:
+        """Get the types of evaluating an expression with `eval_expr`."""
+        if _is_call(node, "expression") and len(node) >= 2:
+            return self.type_of(node[1])
+        if _is_call(node, "ternary") and len(node) == 4:
+            return self._evaluated(node[2]) | self._evaluated(node[3])
+        return ANY
+
+    def mark(self, node: Node) -> Node:
+        """Prefix the builtin calls which can't fail their type checks."""
+        if isinstance(node, str):
+            return node
+
+        head = node[0]
+        args = [self.type_of(arg) for arg in _arguments(node)]
+        marked = [head, *(self.mark(arg) for arg in _arguments(node))]
+
+        if not isinstance(head, str) or head not in SIGNATURES:
+            return marked
+        if head in ("let", "expression"):
+            return marked
+
+        if signature_matches(SIGNATURES[head], args):
+            marked[0] = PROVEN_PREFIX + head
+        return marked
+
+
+def mark_proven_calls(canon: str) -> str:
+    """Mark the builtin calls in canonical code which are always well typed."""
+    try:
+        root = parse(canon)
+    except AssertionError:
+        return canon
+
+    program = Program(root)
+    program.collect(root)
+    if program.is_dynamic or not program.infer():
+        return canon
+
+    return unparse(program.mark(root))
@@ -16,6 +16,7 @@ import regex as re
 import utils
 
 from .errors import SourceError
+from .inference import mark_proven_calls
 from .macro import Arity, BadMacroArity, Macro
 from .numbers import NUMBER_REGEX, SIGNED_LONG_RANGE, get_numeric_or_none
 
@@ -114,6 +115,8 @@ class Preprocessor:
 
     contexts: t.List[t.Optional[p.Path]] = dc.field(default_factory=lambda: [None])
     included: t.Set[p.Path] = dc.field(default_factory=set)
+    # Every file read by `use!` or `include!`.
+    dependencies: t.Set[p.Path] = dc.field(default_factory=set)
     # Ranges corresponding to the tokens
     _traceback: t.List[range] = dc.field(default_factory=list)
     _code: str = None
@@ -123,7 +126,7 @@ class Preprocessor:
         expr = f"(do {expr})"
         self._code = expr
         assert expr.count("(") == expr.count(")")
-        return self._make_canon(expr, stack=True)
+        return mark_proven_calls(self._make_canon(expr, stack=True))
 
     def __post_init__(self):
         self.macros = self._get_macros()
@@ -144,6 +147,7 @@ class Preprocessor:
             if self.contexts[-1] is None:
                 raise LispImportWithoutFileException
 
+        self.dependencies.add(imported_path)
         code = utils.cat(imported_path)
         code = f"(do {code})"
 
@@ -2,19 +2,16 @@
 """Runs the lisp."""
 import argparse
 import functools as ft
-import hashlib
 import logging
 import pathlib as p
 import subprocess
 import sys
 import typing as t
 
-import gen_code
-import preprocess
-import utils
+import canon_cache
 
 BASEPATH = p.Path(__file__).parent
-GCPP_FLAGS = ["-O1", "-fconcepts-ts"]
+GCPP_FLAGS = ["-O1", "-fconcepts-ts", "-pthread"]
 
 
 def _run(*args, **kwargs):
@@ -23,6 +20,19 @@ def _run(*args, **kwargs):
         exit(result.returncode)
 
 
+def _non_negative(convert):
+    """Get an argument type which converts with `convert` and refuses values below 0."""
+
+    def parse(text: str):
+        value = convert(text)
+        if not value >= 0:
+            raise argparse.ArgumentTypeError(f"must not be negative, got {text!r}")
+        return value
+
+    parse.__name__ = convert.__name__
+    return parse
+
+
 def _recompile_if_necessary(args):
     if args.recompile == "never":
         logging.debug(f"Skipping recompilation (--recompile={args.recompile!r}).")
@@ -30,6 +40,10 @@ def _recompile_if_necessary(args):
 
     logging.debug(f"Recompiling code (--recompile={args.recompile!r}).")
 
+    # Imported here, so that runs which don't recompile don't pay for Mako.
+    import gen_code
+    import utils
+
     # Regenerate programmatical headers.
     gen_code.render_all()
 
@@ -91,6 +105,44 @@ def main(argv: t.List[str]) -> None:
         default=False,
         help="run unsafely",
     )
+    parser.add_argument(
+        "--engine",
+        choices=["vm", "tree"],
+        default="vm",
+        help="evaluate with the bytecode virtual machine or the tree walker",
+    )
+    parser.add_argument(
+        "--gc-stats",
+        action="store_const",
+        const=True,
+        default=False,
+        help="print garbage collector statistics on exit",
+    )
+    parser.add_argument(
+        "--max-steps",
+        type=_non_negative(int),
+        default=0,
+        help="most steps to run the program for (0 for no limit)",
+    )
+    parser.add_argument(
+        "--timeout",
+        type=_non_negative(float),
+        default=0,
+        help="most seconds to run the program for (0 for no limit)",
+    )
+    parser.add_argument(
+        "--gc-threshold",
+        type=_non_negative(int),
+        default=0,
+        help="least allocations between garbage collections (0 for the default)",
+    )
+    parser.add_argument(
+        "--cache-stats",
+        action="store_const",
+        const=True,
+        default=False,
+        help="report whether the canon was cached, and the hits and misses so far",
+    )
     parser.add_argument(
         "--recompile",
         choices=["never", "change", "always"],
@@ -110,7 +162,6 @@ def main(argv: t.List[str]) -> None:
     )
 
     args = parser.parse_args()
-    processor = preprocess.Preprocessor()
 
     if args.log != "NEVER":
         logging.basicConfig(level=getattr(logging, args.log.upper()))
@@ -132,23 +183,38 @@ def main(argv: t.List[str]) -> None:
         with open(args.origin, "r", encoding="utf-8") as file:
             file_contents = file.read()
 
-        processor.contexts[-1] = args.origin
+    # Makes the code canon, unless it was made before from the same files.
+    cache_key = canon_cache.key_of(file_contents, args.origin)
+    temp_path = canon_cache.load(cache_key)
+    hit = temp_path is not None
+    stats = canon_cache.count(hit)
 
-    canon = processor.make_canon(file_contents)
+    if not hit:
+        logging.debug(f"Preprocessing the code (cache key: {cache_key}).")
 
-    if args.dump:
-        print(canon)
-        exit(0)
+        # Imported here, so that cache hits don't pay for loading the preprocessor.
+        import preprocess
 
-    # Makes the code canon.
-    temp_path = p.Path(
-        "/tmp/lisp/" + hashlib.md5(canon.encode("utf-8")).hexdigest() + ".lisp"
-    )
-    if not temp_path.parent.exists():
-        temp_path.parent.mkdir()
+        processor = preprocess.Preprocessor()
+        if args.origin is not None:
+            processor.contexts[-1] = args.origin
+
+        canon = processor.make_canon(file_contents)
+        temp_path = canon_cache.store(cache_key, canon, processor.dependencies)
+    else:
+        logging.debug(f"Using the cached canon (cache key: {cache_key}).")
 
-    with open(temp_path, "w", encoding="utf-8") as file:
-        file.write(canon)
+    if args.cache_stats:
+        print(
+            f"Canon cache {'hit' if hit else 'miss'} "
+            f"({stats['hits']} hits, {stats['misses']} misses so far).",
+            file=sys.stderr,
+        )
+
+    if args.dump:
+        with open(temp_path, "r", encoding="utf-8") as file:
+            print(file.read())
+        exit(0)
 
     _recompile_if_necessary(args)
 
@@ -169,8 +235,13 @@ def main(argv: t.List[str]) -> None:
             [
                 str(executable_path),
                 str(temp_path),
-                str(0),
+                str(int(args.log == "DEBUG")),
                 str(int(not args.unsafe)),
+                str(int(args.engine == "vm")),
+                str(int(args.gc_stats)),
+                str(args.max_steps),
+                str(args.timeout),
+                str(args.gc_threshold),
                 *(args.args if args.args is not None else []),
             ]
         )
@@ -16,18 +16,7 @@
 (=> ,, [l r] (, (always_iterable l) (always_iterable r)))
 
 
-(=> filter [f a] (do
-    (= out [])
-    (= i 0)
-    (= l (# a))
-    (while! (< i l) (do
-        (if! (f (@ i a)) (push out (@ i a)))
-        (++ i)
-    ))
-    out
-))
-
-
+; filter is a builtin.
 (= /? filter)
 
 (=> compose [fn0 fn1] #[fn0 (fn1 _)])
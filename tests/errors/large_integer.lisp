@@ -0,0 +1,4 @@
+; Prints: [ParseError] The integer `99999999999999999999` is too large to be a number.
+; Integers which don't fit in 64 bits aren't read as names either.
+(= big (parse "99999999999999999999"))
+(put big)
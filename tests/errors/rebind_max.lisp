@@ -0,0 +1,4 @@
+; Prints: [BindingError] Cannot rebind builtin `max`.
+; The names of builtins always read as the builtins, so binding one is an error.
+(= max 3)
+(put max)
@@ -0,0 +1,3 @@
+; Prints: [BindingError] Cannot rebind builtin `abs`.
+(=> distance {abs} (- abs 1))
+(put (distance 3))
@@ -0,0 +1,3 @@
+; Prints: [BindingError] Cannot rebind builtin `popfront`.
+(= popfront 1)
+(put popfront)
@@ -0,0 +1,3 @@
+; Prints: [BindingError] Cannot rebind builtin `pushfront`.
+(=> prepend {pushfront items} (+ [pushfront] items))
+(put (prepend 0 [1 2]))
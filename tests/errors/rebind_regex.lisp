@@ -0,0 +1,3 @@
+; Prints: [BindingError] Cannot rebind builtin `regex`.
+(= regex "[a-z]+")
+(put regex)
@@ -0,0 +1,3 @@
+; Prints: [BindingError] Cannot rebind builtin `sort`.
+(= sort [3 1 2])
+(put sort)
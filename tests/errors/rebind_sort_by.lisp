@@ -0,0 +1,3 @@
+; Prints: [BindingError] Cannot rebind builtin `stable_sort_by`.
+(=> by_key {stable_sort_by items} (stable_sort_by items))
+(put (by_key (-> x x) [3 1 2]))
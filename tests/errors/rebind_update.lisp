@@ -0,0 +1,7 @@
+; Prints: [BindingError] Cannot rebind builtin `update`.
+; A local used to be able to take the name of what is now a builtin.
+(=> bump {items} (do
+    (= update (+ (@ 0 items) 1))
+    update
+))
+(put (bump [1 2]))
@@ -0,0 +1,34 @@
+(use! "assert")
+
+; Makes garbage in loops and calls while holding on to values in variables,
+; closures and containers, which have to survive every collection on the way.
+(=> make_adder {n} (do
+    (= offset [n n])
+    (=> plus_offset {x} (+ x (@ 0 offset)))
+    plus_offset
+))
+
+(= kept [])
+(= adders [])
+(= i 0)
+(while! (< i 3000) (do
+    (= garbage (repeat 8 [i "garbage"]))
+    (push kept (join "kept " (repr i)))
+    (if! (== (% i 100) 0) (push adders (make_adder i)))
+    (++ i)
+))
+
+(assert_expr_eq {(# kept)} 3000)
+(assert_expr_eq {(@ 2999 kept)} "kept 2999")
+(assert_expr_eq {(# adders)} 30)
+(assert_expr_eq {((@ 29 adders) 1)} 2901)
+
+; Recursion in tail position starts the region of its call again once it has
+; grown, keeping only what the next step is passed.
+(=> build {n acc} (if! (== n 0) acc (build (- n 1) [n (@ 0 acc) "garbage"])))
+(assert_expr_eq {(@ 1 (build 100000 [0]))} 2)
+
+; Values only held by a builtin while it calls closures are kept too.
+(=> copies_made {x} (# (repeat 50 [x])))
+(= lengths (map copies_made (range 0 2000)))
+(assert_expr_eq {(fold + lengths 0)} 100000)
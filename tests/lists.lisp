@@ -0,0 +1,17 @@
+(use! "assert")
+
+; Test using lists as queues.
+(= queue l[1 2 3])
+(pushfront queue 0)
+(push queue 4)
+(assert_expr_eq {queue} l[0 1 2 3 4])
+(assert_expr_eq {(popfront queue)} 0)
+(assert_expr_eq {(pop queue)} 4)
+(assert_expr_eq {(@ 1 queue)} 2)
+(assert_expr_eq {(# queue)} 3)
+
+; Vectors can be used the same way.
+(= items [2])
+(pushfront items 1)
+(assert_expr_eq {items} [1 2])
+(assert_expr_eq {(popfront items)} 1)
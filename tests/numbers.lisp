@@ -0,0 +1,9 @@
+(use! "assert")
+
+; Integers parsed at runtime which are too large to fit next to a tag are boxed,
+; up to the largest 64-bit integer. Their last digits show they aren't rounded.
+(= big (parse "9223372036854775807"))
+(assert_expr_eq {(% big 10)} 7)
+(assert_expr_eq {(% (- big 1) 10)} 6)
+(assert_expr_eq {(% (parse "-9223372036854775808") 10)} -8)
+(assert_expr_eq {(% (parse "4611686018427387905") 1000)} 905)
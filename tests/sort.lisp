@@ -0,0 +1,11 @@
+(use! "assert")
+
+; Test the sorting builtins.
+(assert_expr_eq {(sort [3 1 2])} [1 2 3])
+(assert_expr_eq {(sort [2.5 1 -3])} [-3 1 2.5])
+(assert_expr_eq {(sort ["b" "c" "a"])} ["a" "b" "c"])
+(assert_expr_eq {(sort [])} [])
+(assert_expr_eq {(sort_by #[- 0 _] [1 3 2])} [3 2 1])
+(assert_expr_eq {(sort_by #[# _] ["ccc" "a" "bb"])} ["a" "bb" "ccc"])
+(assert_expr_eq {(stable_sort_by #[% _ 2] [3 2 1 4])} [2 4 3 1])
+(assert_expr_eq {(stable_sort_by #[@ 0 _] [[1 "b"] [0 "c"] [1 "a"]])} [[0 "c"] [1 "b"] [1 "a"]])
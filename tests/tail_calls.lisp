@@ -0,0 +1,30 @@
+(use! "assert")
+
+; Calls in tail position reuse the frame of the caller, so these can recurse
+; far deeper than the call stack could.
+(=> count_down {n acc} (if! (== n 0) acc (count_down (- n 1) (+ acc 1))))
+(assert_expr_eq {(count_down 1000000 0)} 1000000)
+
+; The last form of a `do` and an explicit `return` are tail positions too.
+(=> skip {n} (do
+    (if! (== n 0) (return "done"))
+    (= next (- n 1))
+    (skip next)
+))
+(assert_expr_eq {(skip 1000000)} "done")
+
+(=> is_even {n} (if! (== n 0) Yes (is_odd (- n 1))))
+(=> is_odd {n} (if! (== n 0) No (return (is_even (- n 1)))))
+(assert_expr_eq {(is_even 1000001)} No)
+
+; The callee still sees the variables of the caller.
+(=> outer {n} (do
+    (= offset 10)
+    (=> inner {} (+ n offset))
+    (inner)
+))
+(assert_expr_eq {(outer 5)} 15)
+
+; Calls which are not in tail position still return to their caller.
+(=> depth {n} (if! (== n 0) 0 (+ 1 (depth (- n 1)))))
+(assert_expr_eq {(depth 1000)} 1000)
@@ -4,3 +4,6 @@
 (assert_expr_eq {(typematch [[(type "int") (type "*")]] [1 2 3])} Yes)
 (assert_expr_eq {(typematch [[(type "int") (type "+")]] [1 2 3])} Yes)
 (assert_expr_eq {(typematch [[(type "int") (type "+")]] [])} No)
+(assert_expr_eq {(typematch [[(type "int") (type "*")] [(type "string")]] [1 2 "a"])} Yes)
+(assert_expr_eq {(typematch [[(type "int") (type "*")] [(type "int")]] [1 2 3])} Yes)
+(assert_expr_eq {(typematch [[(type "int") (type "*")] [(type "int")]] [])} No)
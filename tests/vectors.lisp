@@ -0,0 +1,41 @@
+(use! "assert")
+
+; Changing a vector never changes the vectors it was made from.
+(= base (range 100))
+(= longer (push! 100 base))
+(assert_expr_eq {(# base)} 100)
+(assert_expr_eq {(@ -1 longer)} 100)
+
+(= shorter (pop! longer))
+(assert_expr_eq {(# shorter)} 100)
+(= other (push! -1 shorter))
+(assert_expr_eq {(@ -1 longer)} 100)
+(assert_expr_eq {(@ -1 other)} -1)
+
+(= changed (update "x" 50 base))
+(assert_expr_eq {(@ 50 changed)} "x")
+(assert_expr_eq {(@ 50 base)} 50)
+(assert_expr_eq {(update 5 -1 [1 2 3])} [1 2 5])
+
+(= middle (slice base 10 19))
+(assert_expr_eq {middle} [10 11 12 13 14 15 16 17 18 19])
+(push middle 0)
+(assert_expr_eq {(@ 20 base)} 20)
+(assert_expr_eq {(slice [] 0 -1)} [])
+
+; Values rebound in place are still copied once something else refers to them.
+(= text "a")
+(,= text "b")
+(= saved text)
+(,= text "c")
+(assert_expr_eq {saved} "ab")
+(assert_expr_eq {text} "abc")
+
+(= items [1])
+(= items (push! 2 items))
+(= nested [items])
+(= items (push! 3 items))
+(assert_expr_eq {nested} [[1 2]])
+(= items (pop! items))
+(= items (pop! items))
+(assert_expr_eq {items} [1])